@@ -0,0 +1,188 @@
+/*
+ * @file admission.h
+ *
+ * Keeping bursts of cold keys (a crawler walking the grid, say) from
+ * costing the weather service quota and the cache its hot set.
+ *
+ * rate_limited_fetcher puts a token bucket in front of an upstream fetcher.
+ * Part of the bucket is held back for keys that have been fetched before:
+ * fetches are counted in a frequency sketch, and only a key fetched at
+ * least hot_threshold times may use the reserve, so once cold keys have
+ * drained the rest of the bucket the hot set still refreshes. A request that finds no token fails
+ * at once with rate_limited_error rather than queueing.
+ *
+ * doorkeeper is the admission filter of LFU_cache_client::set_doorkeeper():
+ * a Bloom filter of keys that missed recently. A key that misses while the
+ * cache is full is only cached if the doorkeeper already knew it, so a
+ * location requested once is answered but never evicts anything.
+ */
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include "eviction_policies.h"
+#include "forecast_fetcher.h"
+#include "location_key.h"
+
+// Bloom filter over location keys with four hash functions and eight bits
+// per expected key, about 2% false positives when full. It is cleared after
+// expected_keys insertions, so it only remembers recent keys.
+
+class doorkeeper {
+	static const int HASHES = 4;
+
+	std::vector<uint64_t> bits;
+	std::size_t bit_mask;
+	std::size_t insertions = 0, reset_after;
+
+	std::size_t _bit(uint64_t hash, int i) const {
+		// double hashing, the second hash forced odd so every bit is reachable
+		return (std::size_t)(hash + (uint64_t)i * ((hash >> 32) | 1)) & bit_mask;
+	}
+
+	public:
+
+	doorkeeper(std::size_t expected_keys){
+		std::size_t size = 64;
+		while (size < 8 * expected_keys)
+			size <<= 1;
+		bits.assign(size / 64, 0);
+		bit_mask = size - 1;
+		reset_after = std::max<std::size_t>(expected_keys, 1);
+	}
+
+	bool contains(location_key key) const {
+		uint64_t hash = location_key_hash()(key);
+		for (int i = 0; i < HASHES; i++) {
+			std::size_t bit = _bit(hash, i);
+			if (!(bits[bit / 64] >> (bit % 64) & 1))
+				return false;
+		}
+		return true;
+	}
+
+	// adds key, returns whether it was (probably) there already
+	bool insert(location_key key){
+		if (contains(key))
+			return true;
+		if (insertions++ >= reset_after) {
+			clear();
+			insertions = 1;
+		}
+		uint64_t hash = location_key_hash()(key);
+		for (int i = 0; i < HASHES; i++) {
+			std::size_t bit = _bit(hash, i);
+			bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+		}
+		return false;
+	}
+
+	void clear(){
+		std::fill(bits.begin(), bits.end(), 0);
+		insertions = 0;
+	}
+};
+
+class rate_limited_error : public std::runtime_error {
+	public:
+	rate_limited_error() : std::runtime_error("upstream rate limit reached") {};
+};
+
+struct rate_limit {
+	double per_second = 1;       // tokens added per second, the sustained request rate
+	double burst = 60;           // bucket size
+	double hot_reserve = 10;     // tokens only hot keys may take
+	unsigned int hot_threshold = 1; // earlier fetches that make a key hot
+};
+
+// Token bucket. take() spends one token if that leaves at least floor in
+// the bucket; refilling is computed lazily from the elapsed time.
+
+class token_bucket {
+	typedef std::chrono::steady_clock clock;
+
+	double per_second, capacity, tokens;
+	clock::time_point refilled;
+
+	public:
+
+	token_bucket(double per_second, double capacity, clock::time_point now = clock::now())
+		: per_second(per_second), capacity(capacity), tokens(capacity), refilled(now) {};
+
+	bool take(double floor = 0, clock::time_point now = clock::now()){
+		if (now > refilled) {
+			tokens = std::min(capacity, tokens + per_second * std::chrono::duration<double>(now - refilled).count());
+			refilled = now;
+		}
+		if (tokens < floor + 1)
+			return false;
+		tokens -= 1;
+		return true;
+	}
+
+	double available() const { return tokens; }
+};
+
+// Fetcher decorator enforcing a rate_limit on upstream. Keys are counted
+// per grid cell, so nearby requests share their cell's hotness.
+
+class rate_limited_fetcher : public forecast_fetcher {
+	typedef std::chrono::steady_clock clock;
+
+	std::shared_ptr<forecast_fetcher> upstream;
+	rate_limit limit;
+	location_grid grid;
+	std::mutex lock;
+	token_bucket bucket;
+	detail::count_min_sketch<location_key, location_key_hash> fetched;
+	std::function<clock::time_point()> now = clock::now;
+	uint64_t rejected = 0;
+
+	public:
+
+	rate_limited_fetcher(std::shared_ptr<forecast_fetcher> upstream, rate_limit limit = rate_limit(),
+			location_grid grid = location_grid(), std::size_t tracked_keys = 4096)
+		: upstream(std::move(upstream)), limit(limit), grid(grid),
+		  bucket(limit.per_second, limit.burst), fetched(tracked_keys) {};
+
+	// replaces the clock the bucket refills by
+	void set_clock(std::function<clock::time_point()> clock_now){
+		std::lock_guard<std::mutex> guard(lock);
+		now = std::move(clock_now);
+		bucket = token_bucket(limit.per_second, limit.burst, now());
+	}
+
+	void fetch_async(double lat, double lon, callback done) override {
+		auto key = grid.key(lat, lon);
+		bool allowed;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			bool hot = fetched.estimate(key) >= limit.hot_threshold;
+			allowed = bucket.take(hot ? 0 : limit.hot_reserve, now());
+			if (allowed)
+				fetched.add(key);
+			else
+				rejected++;
+		}
+		if (!allowed) {
+			done(nullptr, std::make_exception_ptr(rate_limited_error()));
+			return;
+		}
+		upstream->fetch_async(lat, lon, std::move(done));
+	}
+
+	// requests turned away so far
+	uint64_t rejections(){
+		std::lock_guard<std::mutex> guard(lock);
+		return rejected;
+	}
+};
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * @file benchmark.cpp
+ *
+ * Benchmarks for the clients, separate from the test binary. Every case
+ * runs against synthetic_fetcher, so the network is out of the numbers, is
+ * warmed up before it is measured and reports latency percentiles rather
+ * than a single total. Cases cover resampling at each granularity, the hit
+ * and miss paths, cache sizes under a Zipf distributed multi-location
+ * workload, and the sharded client under concurrent load.
+ *
+ *	./benchmark.out [filter]   runs the cases whose name contains filter
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cache_clients.h"
+#include "metrics.h"
+#include "synthetic.h"
+
+namespace {
+
+const int FIRST_DT = 1659722400;
+
+struct granularity_case {
+	const char *name;
+	int range; // seconds queried, picks the granularity
+};
+
+const granularity_case GRANULARITIES[] = {
+	{"minute", TWO_HOURS - MINUTE},
+	{"five_minutes", ONE_DAY - FIVE_MINUTES},
+	{"hour", 5 * ONE_DAY},
+};
+
+const char *filter = nullptr;
+
+bool selected(const std::string &name){
+	return !filter || name.find(filter) != std::string::npos;
+}
+
+void print_header(){
+	std::printf("%-36s %10s %10s %10s %10s %10s %10s  %s\n",
+		"case", "ops", "mean ns", "p50 ns", "p90 ns", "p99 ns", "max ns", "notes");
+}
+
+void print_row(const std::string &name, const histogram_snapshot &h, const std::string &notes){
+	uint64_t max = 0;
+	for (std::size_t i = 0; i < h.counts.size(); i++)
+		if (h.counts[i])
+			max = latency_histogram::upper_bound(i);
+	std::printf("%-36s %10llu %10.1f %10llu %10llu %10llu %10llu  %s\n", name.c_str(),
+		(unsigned long long)h.count, h.count ? (double)h.sum / (double)h.count : 0.0,
+		(unsigned long long)h.percentile(0.5), (unsigned long long)h.percentile(0.9),
+		(unsigned long long)h.percentile(0.99), (unsigned long long)max, notes.c_str());
+}
+
+// Runs op(i) for i < iterations after iterations / 10 warm-up calls, then
+// warmed() if given. Calls are timed in batches of batch so clock overhead
+// stays out of very short operations; percentiles are then over the
+// per-call mean of each batch. notes() adds to the printed row.
+
+void run(const std::string &name, std::size_t iterations, std::size_t batch,
+		const std::function<void(std::size_t)> &op, std::function<void()> warmed = nullptr,
+		std::function<std::string()> notes = nullptr){
+	if (!selected(name))
+		return;
+	for (std::size_t i = 0; i < iterations / 10; i++)
+		op(i);
+	if (warmed)
+		warmed();
+	latency_histogram histogram;
+	for (std::size_t i = 0; i < iterations; i += batch) {
+		std::size_t ops = std::min(batch, iterations - i); // the last batch may be short
+		auto start = std::chrono::steady_clock::now();
+		for (std::size_t j = i; j < i + ops; j++)
+			op(j);
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / (int64_t)ops;
+		for (std::size_t j = 0; j < ops; j++)
+			histogram.record((uint64_t)ns);
+	}
+	print_row(name, histogram.snapshot(), notes ? notes() : "");
+}
+
+key_pair location_for(int key){
+	return key_pair(30 + (key % 100) * 0.05, -120 + (key / 100) * 0.05);
+}
+
+std::string hit_rate_note(const forecast_metrics &metrics){
+	char note[64];
+	std::snprintf(note, sizeof(note), "hit rate %.3f", metrics.snapshot().hit_rate());
+	return note;
+}
+
+void resample_cases(){
+	auto index = synthetic_fetcher::forecast_for(47.36, -122.19, FIRST_DT);
+	std::vector<double> out(5 * ONE_DAY / MINUTE);
+	for (auto &g : GRANULARITIES) {
+		int granularity = granularity_for(FIRST_DT, FIRST_DT + g.range);
+		std::size_t count = resample_count(index, FIRST_DT, FIRST_DT + g.range, granularity);
+		run(std::string("resample/nearest/") + g.name, 200000, 16, [&](std::size_t) {
+			resample_into(index, FIRST_DT, granularity, out.data(), count);
+		});
+		run(std::string("resample/linear/") + g.name, 200000, 16, [&](std::size_t) {
+			resample_into(index, FIRST_DT, granularity, out.data(), count, resample_mode::linear);
+		});
+	}
+}
+
+void hit_cases(){
+	auto fetcher = std::make_shared<synthetic_fetcher>(FIRST_DT);
+	std::vector<double> out(5 * ONE_DAY / MINUTE);
+	for (auto &g : GRANULARITIES) {
+		LFU_cache_client<> cache(16, expiry_policy(), location_grid(), fetcher);
+		cache.set_pair(47.36, -122.19);
+		run(std::string("hit/window/") + g.name, 200000, 16, [&](std::size_t) {
+			cache.query_window(FIRST_DT, FIRST_DT + g.range);
+		});
+		run(std::string("hit/buffer/") + g.name, 200000, 16, [&](std::size_t) {
+			cache.query(FIRST_DT, FIRST_DT + g.range, out.data(), out.size());
+		});
+	}
+}
+
+void miss_cases(){
+	auto fetcher = std::make_shared<synthetic_fetcher>(FIRST_DT);
+	std::vector<double> out(5 * ONE_DAY / ONE_HOUR);
+	LFU_cache_client<> cache(1, expiry_policy(), location_grid(), fetcher);
+	run("miss/buffer/hour", 100000, 1, [&](std::size_t i) {
+		auto location = location_for((int)(i % 2));
+		cache.set_pair(location.first, location.second);
+		cache.query(FIRST_DT, FIRST_DT + 5 * ONE_DAY, out.data(), out.size());
+	});
+	LFU_cache_client<lfu_policy, resample_stage<>, synthetic_fetcher> direct(1, expiry_policy(), location_grid(), fetcher);
+	run("miss/devirtualized/buffer/hour", 100000, 1, [&](std::size_t i) {
+		auto location = location_for((int)(i % 2));
+		direct.set_pair(location.first, location.second);
+		direct.query(FIRST_DT, FIRST_DT + 5 * ONE_DAY, out.data(), out.size());
+	});
+	run("non_caching/hour", 100000, 1, [&](std::size_t) {
+		NonCachingClient client(47.36, -122.19, fetcher);
+		client.query(FIRST_DT, FIRST_DT + 5 * ONE_DAY);
+	});
+	run("non_caching/devirtualized/hour", 100000, 1, [&](std::size_t) {
+		basic_non_caching_client<synthetic_fetcher> client(47.36, -122.19, fetcher);
+		client.query(FIRST_DT, FIRST_DT + 5 * ONE_DAY);
+	});
+}
+
+template <template <typename, typename> class Policy>
+void zipf_case(const char *policy, std::size_t cache_size, const std::vector<int> &trace){
+	auto fetcher = std::make_shared<synthetic_fetcher>(FIRST_DT);
+	auto metrics = std::make_shared<forecast_metrics>();
+	LFU_cache_client<Policy> cache((unsigned int)cache_size, expiry_policy(), location_grid(), fetcher);
+	cache.set_metrics(metrics);
+	std::vector<double> out(5 * ONE_DAY / ONE_HOUR);
+	run(std::string("zipf/") + policy + "/" + std::to_string(cache_size), trace.size(), 1, [&](std::size_t i) {
+		auto location = location_for(trace[i]);
+		cache.set_pair(location.first, location.second);
+		cache.query(FIRST_DT, FIRST_DT + 5 * ONE_DAY, out.data(), out.size());
+	}, [&]() { metrics->reset(); }, [&]() { return hit_rate_note(*metrics); });
+}
+
+void zipf_cases(){
+	auto trace = zipf_trace(200000, 10000, 11);
+	for (std::size_t size : {64, 512, 4096}) {
+		zipf_case<lfu_policy>("lfu", size, trace);
+		zipf_case<lru_policy>("lru", size, trace);
+		zipf_case<w_tinylfu_policy>("w_tinylfu", size, trace);
+	}
+}
+
+void sharded_cases(){
+	auto trace = zipf_trace(200000, 10000, 13);
+	for (unsigned int threads : {1u, 4u}) {
+		std::string name = "sharded/zipf/512/threads_" + std::to_string(threads);
+		if (!selected(name))
+			continue;
+		auto fetcher = std::make_shared<synthetic_fetcher>(FIRST_DT);
+		auto metrics = std::make_shared<forecast_metrics>();
+		sharded_LFU_cache_client<> cache(512, 8, expiry_policy(), location_grid(), fetcher);
+		cache.set_metrics(metrics);
+		latency_histogram histogram;
+		std::vector<std::thread> workers;
+		for (unsigned int t = 0; t < threads; t++) {
+			workers.emplace_back([&, t]() {
+				std::vector<double> out(5 * ONE_DAY / ONE_HOUR);
+				for (std::size_t i = t; i < trace.size(); i += threads) {
+					auto location = location_for(trace[i]);
+					auto start = std::chrono::steady_clock::now();
+					cache.query(location.first, location.second, FIRST_DT, FIRST_DT + 5 * ONE_DAY, out.data(), out.size());
+					histogram.record(std::chrono::steady_clock::now() - start);
+				}
+			});
+		}
+		for (auto &worker : workers)
+			worker.join();
+		print_row(name, histogram.snapshot(), hit_rate_note(*metrics));
+	}
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		filter = argv[1];
+	print_header();
+	resample_cases();
+	hit_cases();
+	miss_cases();
+	zipf_cases();
+	sharded_cases();
+	return 0;
+}
@@ -0,0 +1,1139 @@
+/*
+ * @file cache_clients.h
+ *
+ * The forecast clients: NonCachingClient, which fetches on every query, the
+ * single threaded LFU_cache_client, the thread-safe sharded_LFU_cache_client
+ * and routed_cache_client, one node of a partitioned cache. They live in a
+ * header so the tests, the benchmarks and the tools share one definition.
+ *
+ * Each is a configuration of the pipeline of forecast_pipeline.h: a fetcher,
+ * an optional cache layer and the resampling Stages, all template
+ * parameters. NonCachingClient is a forecast_pipeline over a fetch_source.
+ * The caching clients fetch their misses through a fetch_source of their
+ * Fetcher and are themselves a pipeline's source, so Fetcher can be a final
+ * fake fetcher that is called without a virtual call and Stages can be fixed
+ * at compile time. cached_pipeline spells out fetch, cache and resample as
+ * one type.
+ */
+#ifndef CACHE_CLIENTS_H
+#define CACHE_CLIENTS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "admission.h"
+#include "forecast_index.h"
+#include "forecast_fetcher.h"
+#include "forecast_pipeline.h"
+#include "forecast_snapshot.h"
+#include "forecast_tier.h"
+#include "location_key.h"
+#include "metrics.h"
+#include "node_routing.h"
+#include "policy_cache.h"
+
+typedef std::pair<double, double> key_pair;
+
+
+
+// Fetches on every query: a forecast_pipeline over a fetch_source for one
+// location (see forecast_pipeline.h). Fetcher may be a concrete, final
+// fetcher type to call it without a virtual call.
+
+template <typename Fetcher = forecast_fetcher, typename Stages = resample_stage<>>
+class basic_non_caching_client {
+	double lat, lon;
+	forecast_pipeline<fetch_source<Fetcher>, Stages> pipeline;
+
+	public:
+
+	basic_non_caching_client(double lat, double lon,
+			std::shared_ptr<Fetcher> fetcher = forecast_fetcher::shared())
+		: lat(lat), lon(lon), pipeline(std::move(fetcher)) {};
+
+	std::vector<double> query(int start, int end, resample_mode mode = resample_mode::nearest) {
+		return pipeline.query(lat, lon, start, end, mode);
+	}
+
+	size_t query(int start, int end, double *out, size_t capacity, resample_mode mode = resample_mode::nearest) {
+		return pipeline.query(lat, lon, start, end, out, capacity, mode);
+	}
+
+	metric_series query_metrics(metric_mask mask, int start, int end, resample_mode mode = resample_mode::nearest) {
+		return pipeline.query_metrics(lat, lon, mask, start, end, mode);
+	}
+
+	void set_metrics(std::shared_ptr<forecast_metrics> sink){
+		pipeline.source().set_metrics(std::move(sink));
+	}
+};
+
+typedef basic_non_caching_client<> NonCachingClient;
+
+
+/*   Client built with caches
+ *
+ *   In-memory design was used to build this caching system. The caching design implemented
+ *   is a Least Frequently used caching system, which removes the least frequently used 
+ *   query when the size of the cache has exceeded. The bookkeeping lives in policy_cache
+ *   (see policy_cache.h): a hash map from the location key to its entry, where with the
+ *   default lfu_policy every entry also sits on an intrusive list for its frequency and
+ *   the frequency buckets are themselves linked in increasing order. A hit moves the
+ *   entry to the tail of the next frequency bucket and eviction takes the head of the
+ *   lowest bucket, so both are constant time. In event of a tie(multiple pairs in one
+ *   frequency) the oldest entry of that frequency is the one removed from the cache.
+ *   Below this structure is visualized(as best as possible)
+ *
+ *			       Oldest pair, and lowest frequency(frequency = 1)
+ *						     |
+ *						     V
+ *		bucket[frequency = 1] -> (lat_key1, lon_key1) <-> (lat_key2, lon_key2)
+ *		        ^ v
+ *		bucket[frequency = 2] -> (lat_key3, lon_key3)
+ *				.
+ *				.
+ *				.
+ *		bucket[frequency = n] -> (lat_keyK, long_keyK) <-> .....
+ *
+ *   Pure LFU never forgets: a location that was hot yesterday outranks everything that
+ *   is hot today. The policy is a template parameter, so LFU_cache_client<aging_lfu_policy>,
+ *   <lru_policy>, <w_tinylfu_policy> or <arc_policy> swap it out (see eviction_policies.h).
+ *
+ *   Entries can also expire (see expiry_policy). An expired entry is dropped when it is
+ *   next looked up, and _sweep() removes the rest in expiry order from a min-heap of
+ *   (expires_at, key) so only entries that are actually due are touched. Heap records
+ *   left behind by refreshed or evicted entries are skipped when they come up.
+ *
+ *   With stale_while_revalidate an expired entry keeps being served while a single
+ *   asynchronous refresh per key fetches the new forecast. The refresh only does the
+ *   network round-trip and parse; its result is installed by the next call into the
+ *   client, so the cache itself is still only touched from the calling thread. Stale
+ *   entries are then only swept once they are max_stale past their expiry, and never
+ *   while their refresh is running.
+ *   _refresh_hot() starts the same refreshes early for the most frequently used keys.
+ *
+ *   Capacity is either a number of locations or a byte_budget. With a budget each entry
+ *   is charged for its index, its cached windows and the cache's bookkeeping, so a few
+ *   long forecasts take the room of many short ones.
+ *
+ *   save_snapshot() writes the cached forecasts to a file that load_snapshot() maps in a
+ *   later process (see forecast_snapshot.h). Misses are then served from the snapshot
+ *   while it is fresh enough, its entries moving into the cache as they are used.
+ *
+ *   With a neighbour_fallback set, a miss is first answered with the nearest cached forecast
+ *   within its radius. Cached keys are bucketed into tiles about one radius wide, so the
+ *   search only looks at the keys in the tiles around the request.
+ *
+ *   Turning a cached forecast into a result is left to Stages (see forecast_pipeline.h),
+ *   the same stages the other clients use.
+ *
+ *   set_doorkeeper() adds admission control for misses (see admission.h): while the cache
+ *   is full, a location missing for the first time is answered but not cached, so a burst
+ *   of one-off locations cannot push the hot set out. Its second miss caches it as usual.
+ */
+
+typedef std::chrono::system_clock forecast_clock;
+
+// Series for several locations in one buffer: location i's samples are
+// values[offsets[i]] up to values[offsets[i + 1]].
+
+struct batch_result {
+	std::vector<double> values;
+	std::vector<size_t> offsets;
+
+	size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+	const double *series(size_t i) const { return values.data() + offsets[i]; }
+	size_t length(size_t i) const { return offsets[i + 1] - offsets[i]; }
+};
+
+// When a cached forecast stops being served. Either limit is disabled by
+// leaving it at zero, the earlier of the two applies otherwise.
+
+struct expiry_policy {
+	forecast_clock::duration max_age = forecast_clock::duration::zero(); // measured from the fetch
+	forecast_clock::duration first_point_lag = forecast_clock::duration::zero(); // how far the first dt may fall behind now
+	bool stale_while_revalidate = false; // serve expired entries while one background refresh runs
+	forecast_clock::duration max_stale = forecast_clock::duration::zero(); // how long past expiry they are served, zero for until refreshed
+};
+
+// Serve a miss from a cached forecast at most radius_km away, and optionally
+// fetch the requested location in the background so the next query gets its
+// own forecast. A radius of zero disables the fallback.
+
+struct neighbour_fallback {
+	double radius_km = 0;
+	bool refresh_exact = false;
+};
+
+// Runs the completions of asynchronous queries that missed, e.g. by posting
+// them to an event loop. Without one they run on the fetcher's thread.
+typedef std::function<void(std::function<void()>)> completion_executor;
+
+// Cache capacity in bytes of memory rather than in entries
+struct byte_budget {
+	size_t bytes;
+};
+
+
+template <template <typename, typename> class Policy = lfu_policy, typename Stages = resample_stage<>,
+	typename Fetcher = forecast_fetcher>
+class LFU_cache_client {
+
+	// a resampled query result kept with the forecast it came from
+	struct resampled_window {
+		int start, granularity;
+		size_t count; // stands in for end, every end giving the same samples matches
+		resample_mode mode;
+		std::shared_ptr<const std::vector<double>> values;
+	};
+	static constexpr size_t WINDOWS_PER_ENTRY = 4;
+
+	struct cache_entry {
+		location_key key;
+		forecast_handle data;
+		forecast_clock::time_point expires_at;
+		forecast_clock::time_point fetched_at;
+		std::vector<resampled_window> windows = {}; // replaced round robin, dropped with the entry
+		size_t next_window = 0;
+	};
+	typedef std::pair<forecast_clock::time_point, location_key> expiry_record;
+	typedef policy_cache<location_key, cache_entry, Policy, location_key_hash> cache_type;
+	static constexpr size_t EXPIRY_QUEUE_SLACK = 64; // records past 2 per entry before a rebuild
+	static constexpr size_t CONTROL_BLOCK_BYTES = 2 * sizeof(long) + sizeof(void *); // shared_ptr counts and vtable
+
+	double client_lat, client_lon;
+	location_grid grid;
+	fetch_source<Fetcher> upstream; // where misses and refreshes are fetched
+	cache_type cache; // lat/lon cell -> indexed data, ordered by the policy
+	expiry_policy expiry;
+	std::function<forecast_clock::time_point()> clock = forecast_clock::now;
+	std::priority_queue<expiry_record, std::vector<expiry_record>, std::greater<expiry_record>> expiry_queue; // soonest first
+	struct pending_refresh {
+		std::future<forecast_handle> data;
+		bool fill; // install even though the key is not cached
+	};
+	std::unordered_map<location_key, pending_refresh, location_key_hash> refreshes; // in flight, one per key
+	std::shared_ptr<const forecast_snapshot> warm; // misses are looked up here before fetching
+	std::shared_ptr<forecast_metrics> metrics = forecast_metrics::global();
+	neighbour_fallback fallback;
+	location_grid tiles; // cells a fallback radius wide
+	std::unordered_map<location_key, std::vector<location_key>, location_key_hash> tile_keys; // cached keys per tile, evicted ones pruned when met
+	std::unique_ptr<doorkeeper> admission; // null when every miss is cached
+	cache_entry held_out; // the last miss the doorkeeper kept out, served once from here
+
+        // pulls data, builds its index once and inserts it into the cache,
+        // the cache evicts the LFU entry itself if it is full. Refreshing an
+        // expired entry keeps its frequency. Misses also sweep expired entries,
+        // before the insert: a forecast can arrive already expired, and the
+        // sweep must not remove the entry handed back.
+
+        cache_entry &_put(location_key key){
+                auto data = _fetch(grid.center(key));
+                _sweep_except(&key);
+                return _admit(key, std::move(data));
+        }
+
+        // _sweep(), leaving keep (about to be replaced) in place if not null
+
+        size_t _sweep_except(const location_key *keep){
+                size_t removed = 0;
+                auto now = clock();
+                while (!expiry_queue.empty() && expiry_queue.top().first <= now) {
+                        auto &due = expiry_queue.top();
+                        auto entry = cache.peek(due.second);
+                        if (entry && _removal_time(entry->expires_at) == due.first &&
+                                        !(keep && *keep == due.second) && !refreshes.count(due.second)) {
+                                cache.erase(due.second);
+                                removed++;
+                        }
+                        expiry_queue.pop();
+                }
+                metrics->expirations.add(removed);
+                return removed;
+        }
+
+        // _install() for a fetched miss, unless the doorkeeper keeps it out
+        // of a full cache; the entry returned then only lasts until the next miss
+
+        cache_entry &_admit(location_key key, forecast_handle data){
+                if (!admission || cache.contains(key) || !cache.full(_data_bytes(*data)) || admission->insert(key))
+                        return _install(key, std::move(data));
+                metrics->rejections.add();
+                auto now = clock();
+                held_out = cache_entry{key, std::move(data), now, now};
+                return held_out;
+        }
+
+        cache_entry &_get_entry(){
+                return _get_entry(grid.key(client_lat, client_lon));
+        }
+
+        cache_entry &_get_entry(location_key key){
+                if (auto hit = _lookup_entry(key))
+                        return *hit;
+                return _put(key);
+        }
+
+        // servable entry for key (counting the access), null if it has to be fetched
+
+        cache_entry *_lookup_entry(location_key key){
+                auto hit = _servable_entry(key);
+                (hit ? metrics->hits : metrics->misses).add();
+                return hit;
+        }
+
+        cache_entry *_servable_entry(location_key key){
+                if (!refreshes.empty())
+                        _collect_refreshes(false);
+                auto hit = cache.find(key);
+                if (hit && hit->expires_at > clock())
+                        return hit;
+                if (hit && expiry.stale_while_revalidate && _removal_time(hit->expires_at) > clock()) {
+                        _start_refresh(key);
+                        return hit;
+                }
+                if (hit) {
+                        metrics->expirations.add();
+                        return nullptr;
+                }
+                if (warm && (hit = _warm_entry(key)))
+                        return hit;
+                if (fallback.radius_km > 0 && (hit = _nearest_entry(key)) && fallback.refresh_exact)
+                        _start_refresh(key, true);
+                return hit;
+        }
+
+        // nearest unexpired entry within the fallback radius of key's cell, null if none
+
+        cache_entry *_nearest_entry(location_key key){
+                auto origin = grid.center(key);
+                double tile = tiles.cell_degrees();
+                double lat_span = fallback.radius_km / KM_PER_DEGREE;
+                double lon_span = lat_span / std::max(0.01, std::cos(origin.first * 3.14159265358979323846 / 180.0));
+                int lat_tiles = (int)std::ceil(lat_span / tile);
+                int lon_tiles = (int)std::min(std::ceil(lon_span / tile), 180.0 / tile);
+                auto now = clock();
+                location_key best = 0;
+                double best_km = fallback.radius_km;
+                bool found = false;
+                for (int i = -lat_tiles; i <= lat_tiles; i++) {
+                        for (int j = -lon_tiles; j <= lon_tiles; j++) {
+                                auto bucket = tile_keys.find(tiles.key(origin.first + i * tile, origin.second + j * tile));
+                                if (bucket == tile_keys.end())
+                                        continue;
+                                auto &keys = bucket->second;
+                                for (size_t k = 0; k < keys.size();) {
+                                        auto entry = cache.peek(keys[k]);
+                                        if (!entry) {
+                                                keys[k] = keys.back();
+                                                keys.pop_back();
+                                                continue;
+                                        }
+                                        double km = haversine_km(origin, grid.center(keys[k]));
+                                        if (entry->expires_at > now && km <= best_km) {
+                                                best = keys[k];
+                                                best_km = km;
+                                                found = true;
+                                        }
+                                        k++;
+                                }
+                                if (keys.empty())
+                                        tile_keys.erase(bucket);
+                        }
+                }
+                return found ? cache.find(best) : nullptr;
+        }
+
+        void _index_tile(location_key key){
+                auto center = grid.center(key);
+                auto &keys = tile_keys[tiles.key(center.first, center.second)];
+                if (std::find(keys.begin(), keys.end(), key) == keys.end())
+                        keys.push_back(key);
+        }
+
+        // installs key's forecast from the snapshot if it has one that has not expired
+
+        cache_entry *_warm_entry(location_key key){
+                forecast_handle data;
+                int64_t fetched_at;
+                if (!warm->find(key, data, fetched_at))
+                        return nullptr;
+                auto when = forecast_clock::from_time_t(fetched_at);
+                if (_expiry_for(*data, when) <= clock())
+                        return nullptr;
+                return &_install(key, std::move(data), when);
+        }
+
+        cache_entry &_install(location_key key, forecast_handle data){
+                return _install(key, std::move(data), clock());
+        }
+
+        cache_entry &_install(location_key key, forecast_handle data, forecast_clock::time_point fetched_at){
+                auto expires_at = _expiry_for(*data, fetched_at);
+                auto remove_at = _removal_time(expires_at);
+                if (remove_at != forecast_clock::time_point::max())
+                        expiry_queue.push({remove_at, key});
+                size_t bytes = _data_bytes(*data);
+                if (fallback.radius_km > 0 && !cache.contains(key))
+                        _index_tile(key);
+                auto evicted = cache.evictions();
+                auto &entry = cache.insert(key, {key, std::move(data), expires_at, fetched_at}, bytes);
+                metrics->evictions.add(cache.evictions() - evicted);
+                if (expiry_queue.size() > 2 * cache.size() + EXPIRY_QUEUE_SLACK)
+                        _rebuild_expiry_queue();
+                return entry;
+        }
+
+        // Every install queues a record and only the sweep drops them, so a
+        // key refreshed more often than it expires piles records up. Once
+        // they outnumber the entries twice over the queue is rebuilt from the
+        // live entries, which keeps it within a constant factor of the cache.
+
+        void _rebuild_expiry_queue(){
+                std::vector<expiry_record> live;
+                live.reserve(cache.size());
+                cache.for_each_hottest([&](location_key key, const cache_entry &entry) {
+                        auto remove_at = _removal_time(entry.expires_at);
+                        if (remove_at != forecast_clock::time_point::max())
+                                live.push_back({remove_at, key});
+                });
+                expiry_queue = decltype(expiry_queue)(std::greater<expiry_record>(), std::move(live));
+        }
+
+        // memory held by an entry's forecast and windows, the cache adds its own overhead
+
+        static size_t _data_bytes(const forecast_index &data){
+                return data.size_bytes() + CONTROL_BLOCK_BYTES;
+        }
+
+        static size_t _entry_bytes(const cache_entry &entry){
+                size_t bytes = _data_bytes(*entry.data) + entry.windows.capacity() * sizeof(resampled_window);
+                for (auto &window : entry.windows)
+                        bytes += sizeof(std::vector<double>) + CONTROL_BLOCK_BYTES + window.values->capacity() * sizeof(double);
+                return bytes;
+        }
+
+        // starts a background refresh of key unless one is already running,
+        // fill installs the result even if key is not cached by then
+
+        void _start_refresh(location_key key, bool fill = false){
+                if (refreshes.count(key))
+                        return;
+                auto location = grid.center(key);
+                refreshes.emplace(key, pending_refresh{upstream.get_future(location.first, location.second), fill});
+        }
+
+        // installs finished refreshes. Keys evicted in the meantime are not
+        // brought back unless the refresh was a fill, and a failed refresh
+        // leaves the stale entry in place so the next access retries it.
+
+        void _collect_refreshes(bool wait){
+                for (auto it = refreshes.begin(); it != refreshes.end();) {
+                        if (!wait && it->second.data.wait_for(std::chrono::seconds::zero()) != std::future_status::ready) {
+                                ++it;
+                                continue;
+                        }
+                        try {
+                                auto data = it->second.data.get();
+                                if (it->second.fill || cache.contains(it->first))
+                                        _install(it->first, std::move(data));
+                        } catch (const std::exception &) {
+                        }
+                        it = refreshes.erase(it);
+                }
+        }
+
+        // time at which a forecast fetched at fetched_at stops being served
+
+        forecast_clock::time_point _expiry_for(const forecast_index &data, forecast_clock::time_point fetched_at){
+                auto expires_at = forecast_clock::time_point::max();
+                if (expiry.max_age != forecast_clock::duration::zero())
+                        expires_at = fetched_at + expiry.max_age;
+                if (expiry.first_point_lag != forecast_clock::duration::zero() && !data.empty()) {
+                        auto first = forecast_clock::from_time_t(data.first_time());
+                        expires_at = std::min(expires_at, first + expiry.first_point_lag);
+                }
+                return expires_at;
+        }
+
+        // when _sweep() may remove an entry expiring at expires_at: at once,
+        // or with stale_while_revalidate once it is max_stale past it
+
+        forecast_clock::time_point _removal_time(forecast_clock::time_point expires_at) const {
+                if (!expiry.stale_while_revalidate)
+                        return expires_at;
+                if (expiry.max_stale == forecast_clock::duration::zero() ||
+                                expires_at >= forecast_clock::time_point::max() - expiry.max_stale)
+                        return forecast_clock::time_point::max();
+                return expires_at + expiry.max_stale;
+        }
+
+	public:
+
+	// Set cache size, and optionally when entries expire and how finely
+	// locations are told apart
+	LFU_cache_client(unsigned int cache_size, expiry_policy expiry = expiry_policy(),
+			location_grid grid = location_grid(),
+			std::shared_ptr<Fetcher> fetcher = forecast_fetcher::shared())
+		: grid(grid), upstream(std::move(fetcher)), cache(cache_size), expiry(expiry) {};
+
+	// Same, but bounded by memory: entries are evicted until the forecasts,
+	// windows and bookkeeping held fit in budget.bytes
+	LFU_cache_client(byte_budget budget, expiry_policy expiry = expiry_policy(),
+			location_grid grid = location_grid(),
+			std::shared_ptr<Fetcher> fetcher = forecast_fetcher::shared())
+		: grid(grid), upstream(std::move(fetcher)),
+		  cache(std::max<size_t>(1, budget.bytes / cache_type::ENTRY_OVERHEAD), budget.bytes), // no more entries than could ever fit
+		  expiry(expiry) {};
+
+	const location_grid &get_grid() const { return grid; }
+
+	// replaces the wall clock used for expiry
+	void set_clock(std::function<forecast_clock::time_point()> now){
+		clock = std::move(now);
+	}
+	
+	// define lat/lon
+	void set_pair(double lat, double lon){
+		client_lat = lat; 
+		client_lon = lon;
+	} 
+	
+	// looks for pair(lat/lon) in cache, if found(hit) and not expired
+	// the access is counted and the results returned
+	// if not found(cache miss) or expired call _put()
+
+	// The handle refers to the entry's own index, nothing is copied on a hit
+
+	const forecast_handle &_get(){
+		return _get_entry().data;
+	}
+
+	// _get() for lat/lon instead of the current pair: the source interface
+	// of forecast_pipeline, see cached_pipeline
+	forecast_handle get(double lat, double lon){
+		return _get_entry(grid.key(lat, lon)).data;
+	}
+
+	// The two halves of _get(), for callers that fetch on their own:
+	// _lookup() returns the servable entry for key (counting the access)
+	// or null when it has to be fetched, _store() caches a fetched forecast.
+	// fetched_at, if given, is set to when a hit was fetched.
+
+	const forecast_handle *_lookup(location_key key, forecast_clock::time_point *fetched_at = nullptr){
+		auto hit = _lookup_entry(key);
+		if (hit && fetched_at)
+			*fetched_at = hit->fetched_at;
+		return hit ? &hit->data : nullptr;
+	}
+
+	// caches data fetched just now for key, with its fetch time as recorded
+	// in fetched_at if that is given
+
+	const forecast_handle &_store(location_key key, forecast_handle data, forecast_clock::time_point *fetched_at = nullptr){
+		_sweep_except(&key); // first, see _put()
+		auto &entry = _admit(key, std::move(data));
+		if (fetched_at)
+			*fetched_at = entry.fetched_at;
+		return entry.data;
+	}
+
+	// fetches and indexes the forecast for a lat/lon, safe to call from any thread
+
+	forecast_handle _fetch(key_pair location){
+		return upstream.get(location.first, location.second);
+	}
+
+	// starts background refreshes for the n hottest entries (most frequently
+	// used with LFU) that expire within ahead, returns how many were started
+
+	size_t _refresh_hot(size_t n, forecast_clock::duration ahead){
+		auto deadline = clock() + ahead;
+		std::vector<location_key> due;
+		cache.for_each_hottest([&](location_key key, const cache_entry &entry) {
+			if (entry.expires_at <= deadline && !refreshes.count(key))
+				due.push_back(key);
+		}, n);
+		for (auto &key : due)
+			_start_refresh(key);
+		return due.size();
+	}
+
+	// blocks until every running refresh has been installed
+	void _wait_refreshes(){
+		_collect_refreshes(true);
+	}
+
+	// removes every expired entry (see _removal_time()), returns how many were removed
+
+	size_t _sweep(){
+		return _sweep_except(nullptr);
+	}
+
+	size_t size() const { return cache.size(); }
+
+	// records in the expiry queue, current or superseded
+	size_t _expiry_records() const { return expiry_queue.size(); }
+
+	// Writes the cached forecasts to a snapshot file at path, throws
+	// std::runtime_error if it cannot be written
+
+	void save_snapshot(const std::string &path){
+		std::vector<snapshot_entry> entries;
+		_snapshot_entries(entries);
+		forecast_snapshot::save(path, std::move(entries), grid, forecast_clock::to_time_t(clock()));
+	}
+
+	// appends every cached forecast, for writing one snapshot of several caches
+	void _snapshot_entries(std::vector<snapshot_entry> &entries){
+		cache.for_each_hottest([&](location_key key, const cache_entry &entry) {
+			entries.push_back({key, (int64_t)forecast_clock::to_time_t(entry.fetched_at), entry.data});
+		});
+	}
+
+	// Serves misses from the snapshot at path if it validates and was saved
+	// at most ttl ago (zero accepts any age), returns whether it is used
+	bool load_snapshot(const std::string &path, forecast_clock::duration ttl = forecast_clock::duration::zero()){
+		warm = forecast_snapshot::open(path, grid, forecast_clock::to_time_t(clock()),
+			std::chrono::duration_cast<std::chrono::seconds>(ttl).count());
+		return warm != nullptr;
+	}
+
+	// uses an already opened snapshot, null to stop using one
+	void _set_snapshot(std::shared_ptr<const forecast_snapshot> snapshot){
+		warm = std::move(snapshot);
+	}
+
+	// reports into metrics instead of forecast_metrics::global()
+	void set_metrics(std::shared_ptr<forecast_metrics> sink){
+		metrics = std::move(sink);
+	}
+
+	forecast_metrics &get_metrics() { return *metrics; }
+
+	// turns the nearby fallback on (radius_km > 0) or off
+	void set_neighbour_fallback(neighbour_fallback options){
+		fallback = options;
+		tile_keys.clear();
+		if (fallback.radius_km <= 0)
+			return;
+		tiles = location_grid(std::max(grid.cell_degrees(), fallback.radius_km / KM_PER_DEGREE));
+		cache.for_each_hottest([&](location_key key, const cache_entry &) { _index_tile(key); });
+	}
+
+	// Only caches a miss on a full cache if the key missed recently, keys
+	// being remembered by a doorkeeper sized for recent_keys; 0 turns it off
+	void set_doorkeeper(size_t recent_keys){
+		admission = recent_keys ? std::make_unique<doorkeeper>(recent_keys) : nullptr;
+	}
+
+	// memory charged against the byte budget (tracked without one too)
+	size_t bytes_used() const { return cache.bytes_used(); }
+
+	void _clear(){
+		_collect_refreshes(true);
+		cache.clear();
+		tile_keys.clear();
+		expiry_queue = decltype(expiry_queue)();
+	}
+
+        std::vector<double> query(int start, int end, resample_mode mode = resample_mode::nearest) {
+                return *query_window(start, end, mode); // goes through _get(), so the data and the window are both cached
+        }
+
+	// Like query(), but the series is shared with the entry: the last few
+	// windows queried for a location are kept with its forecast, so polling
+	// the same range returns the stored result without resampling. The
+	// windows go away with the forecast when it is refreshed or evicted.
+
+	std::shared_ptr<const std::vector<double>> query_window(int start, int end,
+			resample_mode mode = resample_mode::nearest) {
+		cache_entry &entry = _get_entry();
+		auto granularity = Stages::granularity(start, end);
+		size_t count = Stages::count(*entry.data, start, end);
+		for (auto &window : entry.windows) {
+			if (window.start == start && window.count == count &&
+					window.granularity == granularity && window.mode == mode)
+				return window.values;
+		}
+		auto values = std::make_shared<const std::vector<double>>(Stages::series(*entry.data, start, end, mode, metrics->resample));
+		resampled_window window = {start, granularity, count, mode, values};
+		if (entry.windows.size() < WINDOWS_PER_ENTRY)
+			entry.windows.push_back(std::move(window));
+		else
+			entry.windows[entry.next_window++ % WINDOWS_PER_ENTRY] = std::move(window);
+		auto evicted = cache.evictions();
+		cache.resize(entry.key, _entry_bytes(entry));
+		metrics->evictions.add(cache.evictions() - evicted);
+		return values;
+	}
+
+	// Writes the series into out instead of allocating one. At most capacity
+	// samples are written; the return value is the full length of the series,
+	// so a larger result than capacity means out was too small.
+
+	size_t query(int start, int end, double *out, size_t capacity, resample_mode mode = resample_mode::nearest) {
+		return Stages::series_into(*_get(), start, end, out, capacity, mode, metrics->resample);
+	}
+
+	// Samples several metrics of the cached forecast over one range, e.g.
+	// metric::temperature | metric::humidity, walking its time index once.
+	// Metrics the forecast does not carry are left out of the result.
+
+	metric_series query_metrics(metric_mask mask, int start, int end, resample_mode mode = resample_mode::nearest) {
+		return Stages::metrics(*_get(), mask, start, end, mode, metrics->resample);
+	}
+
+	// Read-only view of the cached forecast for the current pair. It stays
+	// valid after the entry is evicted or refreshed; the cache just drops its
+	// own reference then.
+
+	forecast_handle view(){
+		return _get();
+	}
+
+	// Queries every location over the same range. Hits are resolved in one
+	// pass, the distinct missing locations are then fetched at the same time
+	// through the fetcher, and all series are written into one buffer.
+
+	batch_result query_batch(const std::vector<key_pair> &locations, int start, int end,
+			resample_mode mode = resample_mode::nearest) {
+		std::vector<forecast_handle> data(locations.size());
+		std::vector<location_key> keys(locations.size());
+		std::unordered_map<location_key, std::future<forecast_handle>, location_key_hash> misses;
+		for (size_t i = 0; i < locations.size(); i++) {
+			keys[i] = grid.key(locations[i].first, locations[i].second);
+			if (auto hit = _lookup(keys[i])) {
+				data[i] = *hit;
+			} else if (!misses.count(keys[i])) {
+				auto location = grid.center(keys[i]);
+				misses.emplace(keys[i], upstream.get_future(location.first, location.second));
+			}
+		}
+		std::unordered_map<location_key, forecast_handle, location_key_hash> fetched;
+		for (auto &miss : misses)
+			fetched.emplace(miss.first, _store(miss.first, miss.second.get()));
+		scoped_timer timer(metrics->resample);
+		batch_result result;
+		result.offsets.reserve(locations.size() + 1);
+		result.offsets.push_back(0);
+		for (size_t i = 0; i < locations.size(); i++) {
+			if (!data[i])
+				data[i] = fetched[keys[i]];
+			result.offsets.push_back(result.offsets.back() + Stages::count(*data[i], start, end));
+		}
+		result.values.resize(result.offsets.back());
+		for (size_t i = 0; i < locations.size(); i++)
+			Stages::into(*data[i], start, end, result.values.data() + result.offsets[i], result.length(i), mode);
+		return result;
+	}
+	
+};
+
+/*   Thread-safe client built with caches
+ *
+ *   Splits the cache into shards by hashed location key, each an LFU_cache_client behind
+ *   its own mutex, so requests for different locations rarely contend. The location
+ *   is passed to every call instead of being held by the client, which lets one
+ *   instance serve all request threads. A shard is only locked for the lookup and
+ *   the insert: fetching on a miss and resampling happen outside the lock, the latter
+ *   on a shared handle that stays valid even if the entry is evicted meanwhile. The
+ *   capacity given is split evenly across the shards.
+ *
+ *   Misses are coalesced per key: the first thread to miss registers a shared_future
+ *   in its shard's in_flight map and does the fetch, later threads missing on the same
+ *   key wait on that future and get the same forecast (or the same exception).
+ *
+ *   async_query() does not block: a hit completes inline, on the calling thread, and a miss
+ *   hands a callback to the fetcher and returns, so a few threads can keep thousands of
+ *   queries in flight. Asynchronous misses join the same per-key coalescing as blocking ones.
+ *   The client has to outlive the asynchronous queries it started.
+ */
+
+template <template <typename, typename> class Policy = lfu_policy, typename Stages = resample_stage<>,
+	typename Fetcher = forecast_fetcher>
+class sharded_LFU_cache_client
+	: public pipeline_queries<sharded_LFU_cache_client<Policy, Stages, Fetcher>, Stages> {
+
+	// a miss being fetched, waited on by blocking callers through future
+	// and by asynchronous ones through waiters
+	struct pending_fetch {
+		std::shared_ptr<std::promise<forecast_handle>> result = std::make_shared<std::promise<forecast_handle>>();
+		std::shared_future<forecast_handle> future = result->get_future().share();
+		std::shared_ptr<forecast_clock::time_point> fetched_at = std::make_shared<forecast_clock::time_point>(); // set before result
+		std::vector<forecast_fetcher::callback> waiters;
+	};
+
+	struct shard {
+		std::mutex lock;
+		LFU_cache_client<Policy, Stages, Fetcher> cache;
+		std::unordered_map<location_key, pending_fetch, location_key_hash> in_flight; // misses being fetched
+
+		template <typename Capacity>
+		shard(Capacity capacity, expiry_policy expiry, location_grid grid,
+				std::shared_ptr<Fetcher> fetcher)
+			: cache(capacity, expiry, grid, fetcher) {};
+	};
+
+	location_grid grid;
+	fetch_source<Fetcher> upstream;
+	std::vector<std::unique_ptr<shard>> shards;
+	std::shared_ptr<forecast_metrics> metrics = forecast_metrics::global();
+
+	completion_executor executor;
+
+	shard &_shard_for(location_key key){
+		return *shards[location_key_hash()(key) % shards.size()];
+	}
+
+	// ends the fetch of key: caches the forecast, then wakes the blocking
+	// waiters and runs the asynchronous ones (on the executor if there is
+	// one). Returns the fetch time reported to every waiter.
+
+	forecast_clock::time_point _complete(shard &s, location_key key, forecast_handle data, std::exception_ptr error){
+		std::shared_ptr<std::promise<forecast_handle>> result;
+		std::vector<forecast_fetcher::callback> waiters;
+		auto fetched_at = forecast_clock::now();
+		{
+			std::lock_guard<std::mutex> guard(s.lock);
+			if (!error)
+				s.cache._store(key, data, &fetched_at);
+			auto it = s.in_flight.find(key);
+			*it->second.fetched_at = fetched_at;
+			result = std::move(it->second.result);
+			waiters = std::move(it->second.waiters);
+			s.in_flight.erase(it);
+		}
+		if (error)
+			result->set_exception(error);
+		else
+			result->set_value(data);
+		for (auto &waiter : waiters) {
+			if (executor)
+				executor([waiter, data, error]() { waiter(data, error); });
+			else
+				waiter(data, error);
+		}
+		return fetched_at;
+	}
+
+	public:
+
+	const location_grid &get_grid() const { return grid; }
+
+	// see LFU_cache_client::set_metrics(), applies to every shard
+	void set_metrics(std::shared_ptr<forecast_metrics> sink){
+		for (auto &s : shards) {
+			std::lock_guard<std::mutex> guard(s->lock);
+			s->cache.set_metrics(sink);
+		}
+		metrics = std::move(sink);
+	}
+
+	forecast_metrics &get_metrics() { return *metrics; }
+
+	// see LFU_cache_client::set_doorkeeper(), recent_keys is split across the shards
+	void set_doorkeeper(size_t recent_keys){
+		for (auto &s : shards) {
+			std::lock_guard<std::mutex> guard(s->lock);
+			s->cache.set_doorkeeper(recent_keys ? std::max<size_t>(1, recent_keys / shards.size()) : 0);
+		}
+	}
+
+	// where asynchronous misses complete, set before queries are made
+	void set_executor(completion_executor run){
+		executor = std::move(run);
+	}
+
+	sharded_LFU_cache_client(unsigned int cache_size,
+			unsigned int shard_count = std::max(1u, std::thread::hardware_concurrency()),
+			expiry_policy expiry = expiry_policy(), location_grid grid = location_grid(),
+			std::shared_ptr<Fetcher> fetcher = forecast_fetcher::shared())
+		: grid(grid), upstream(fetcher) {
+		shard_count = std::max(1u, shard_count);
+		unsigned int per_shard = (cache_size + shard_count - 1) / shard_count;
+		for (unsigned int i = 0; i < shard_count; i++)
+			shards.push_back(std::make_unique<shard>(per_shard, expiry, grid, fetcher));
+	}
+
+	// byte bounded variant, the budget is split evenly across the shards
+	sharded_LFU_cache_client(byte_budget budget,
+			unsigned int shard_count = std::max(1u, std::thread::hardware_concurrency()),
+			expiry_policy expiry = expiry_policy(), location_grid grid = location_grid(),
+			std::shared_ptr<Fetcher> fetcher = forecast_fetcher::shared())
+		: grid(grid), upstream(fetcher) {
+		shard_count = std::max(1u, shard_count);
+		byte_budget per_shard = {budget.bytes / shard_count};
+		for (unsigned int i = 0; i < shard_count; i++)
+			shards.push_back(std::make_unique<shard>(per_shard, expiry, grid, fetcher));
+	}
+
+	// returns the (possibly just fetched) forecast for lat/lon, and when it
+	// was fetched in fetched_at if that is given
+	forecast_handle _get(double lat, double lon, forecast_clock::time_point *fetched_at = nullptr){
+		auto key = grid.key(lat, lon);
+		auto &s = _shard_for(key);
+		std::shared_future<forecast_handle> pending;
+		std::shared_ptr<forecast_clock::time_point> pending_fetched_at;
+		{
+			std::lock_guard<std::mutex> guard(s.lock);
+			if (auto hit = s.cache._lookup(key, fetched_at))
+				return *hit;
+			auto it = s.in_flight.find(key);
+			if (it != s.in_flight.end()) {
+				pending = it->second.future;
+				pending_fetched_at = it->second.fetched_at;
+			} else
+				s.in_flight.emplace(key, pending_fetch());
+		}
+		if (pending.valid()) {
+			auto data = pending.get();
+			if (fetched_at)
+				*fetched_at = *pending_fetched_at;
+			return data;
+		}
+		auto location = grid.center(key);
+		forecast_handle data;
+		try {
+			data = upstream.get(location.first, location.second);
+		} catch (...) {
+			_complete(s, key, nullptr, std::current_exception());
+			throw;
+		}
+		auto completed = _complete(s, key, data, nullptr);
+		if (fetched_at)
+			*fetched_at = completed;
+		return data;
+	}
+
+	// Non-blocking _get(): calls done with the forecast for lat/lon, inline
+	// on a hit, from the fetch's completion on a miss.
+
+	void _get_async(double lat, double lon, forecast_fetcher::callback done){
+		auto key = grid.key(lat, lon);
+		auto &s = _shard_for(key);
+		{
+			std::unique_lock<std::mutex> guard(s.lock);
+			if (auto hit = s.cache._lookup(key)) {
+				auto data = *hit;
+				guard.unlock();
+				done(std::move(data), nullptr);
+				return;
+			}
+			auto it = s.in_flight.find(key);
+			if (it != s.in_flight.end()) {
+				it->second.waiters.push_back(std::move(done));
+				return;
+			}
+			s.in_flight.emplace(key, pending_fetch()).first->second.waiters.push_back(std::move(done));
+		}
+		auto location = grid.center(key);
+		try {
+			upstream.get_async(location.first, location.second, [this, &s, key](forecast_handle data, std::exception_ptr error) {
+				_complete(s, key, std::move(data), error);
+			});
+		} catch (...) {
+			_complete(s, key, nullptr, std::current_exception());
+		}
+	}
+
+	typedef std::function<void(std::vector<double>, std::exception_ptr)> query_callback;
+
+	// Asynchronous query(): done gets the series or the exception that
+	// stopped the fetch. It runs inline on a hit, otherwise on the executor
+	// or the fetcher's thread.
+
+	void async_query(double lat, double lon, int start, int end, query_callback done,
+			resample_mode mode = resample_mode::nearest) {
+		auto sink = metrics;
+		_get_async(lat, lon, [sink, start, end, mode, done](forecast_handle data, std::exception_ptr error) {
+			if (error) {
+				done(std::vector<double>(), error);
+				return;
+			}
+			std::vector<double> values;
+			try {
+				values = Stages::series(*data, start, end, mode, sink->resample);
+			} catch (...) {
+				done(std::vector<double>(), std::current_exception());
+				return;
+			}
+			done(std::move(values), nullptr);
+		});
+	}
+
+	// future variant of async_query(), already ready on a hit
+	std::future<std::vector<double>> async_query(double lat, double lon, int start, int end,
+			resample_mode mode = resample_mode::nearest) {
+		auto result = std::make_shared<std::promise<std::vector<double>>>();
+		auto future = result->get_future();
+		async_query(lat, lon, start, end, [result](std::vector<double> values, std::exception_ptr error) {
+			if (error)
+				result->set_exception(error);
+			else
+				result->set_value(std::move(values));
+		}, mode);
+		return future;
+	}
+
+	// query(), query() into a buffer and query_metrics() come from
+	// pipeline_queries, over this
+	forecast_handle get(double lat, double lon){
+		return _get(lat, lon);
+	}
+
+	size_t _sweep(){
+		size_t removed = 0;
+		for (auto &s : shards) {
+			std::lock_guard<std::mutex> guard(s->lock);
+			removed += s->cache._sweep();
+		}
+		return removed;
+	}
+
+	size_t size(){
+		size_t total = 0;
+		for (auto &s : shards) {
+			std::lock_guard<std::mutex> guard(s->lock);
+			total += s->cache.size();
+		}
+		return total;
+	}
+
+	// see LFU_cache_client::save_snapshot(), the shards are written to one file
+	void save_snapshot(const std::string &path){
+		std::vector<snapshot_entry> entries;
+		for (auto &s : shards) {
+			std::lock_guard<std::mutex> guard(s->lock);
+			s->cache._snapshot_entries(entries);
+		}
+		forecast_snapshot::save(path, std::move(entries), grid, forecast_clock::to_time_t(forecast_clock::now()));
+	}
+
+	// see LFU_cache_client::load_snapshot(), one mapping is shared by the shards
+	bool load_snapshot(const std::string &path, forecast_clock::duration ttl = forecast_clock::duration::zero()){
+		auto snapshot = forecast_snapshot::open(path, grid, forecast_clock::to_time_t(forecast_clock::now()),
+			std::chrono::duration_cast<std::chrono::seconds>(ttl).count());
+		for (auto &s : shards) {
+			std::lock_guard<std::mutex> guard(s->lock);
+			s->cache._set_snapshot(snapshot);
+		}
+		return snapshot != nullptr;
+	}
+
+	size_t bytes_used(){
+		size_t total = 0;
+		for (auto &s : shards) {
+			std::lock_guard<std::mutex> guard(s->lock);
+			total += s->cache.bytes_used();
+		}
+		return total;
+	}
+
+	void _clear(){
+		for (auto &s : shards) {
+			std::lock_guard<std::mutex> guard(s->lock);
+			s->cache._clear();
+		}
+	}
+};
+
+/*   Client for one node of a partitioned cache
+ *
+ *   Locations are divided between the cache nodes by a consistent hash ring over the
+ *   location key (see node_routing.h), so the nodes' caches hold disjoint slices instead
+ *   of a copy of the same hot set each. A query for a key this node owns is answered by
+ *   its local sharded cache; any other key is forwarded to its owner through the transport
+ *   and the answer is not cached here. If the owner cannot be reached the node serves the
+ *   key itself rather than fail the query.
+ *
+ *   Nodes are added and removed at runtime for rebalancing. Keys a node stops owning are
+ *   not moved, they age out of its cache once they stop being queried there.
+ */
+
+template <template <typename, typename> class Policy = lfu_policy, typename Stages = resample_stage<>,
+	typename Fetcher = forecast_fetcher>
+class routed_cache_client
+	: public pipeline_queries<routed_cache_client<Policy, Stages, Fetcher>, Stages> {
+	std::string self;
+	std::shared_ptr<node_transport> transport;
+	sharded_LFU_cache_client<Policy, Stages, Fetcher> local;
+	std::shared_mutex ring_lock;
+	hash_ring ring;
+
+	public:
+
+	routed_cache_client(std::string self, std::shared_ptr<node_transport> transport,
+			unsigned int cache_size, unsigned int virtual_nodes = 64,
+			unsigned int shard_count = std::max(1u, std::thread::hardware_concurrency()),
+			expiry_policy expiry = expiry_policy(), location_grid grid = location_grid(),
+			std::shared_ptr<Fetcher> fetcher = forecast_fetcher::shared())
+		: self(std::move(self)), transport(std::move(transport)),
+		  local(cache_size, shard_count, expiry, grid, std::move(fetcher)) {
+		ring.add_node(this->self, virtual_nodes);
+	}
+
+	void add_node(const std::string &node, unsigned int virtual_nodes = 64){
+		std::unique_lock<std::shared_mutex> guard(ring_lock);
+		ring.add_node(node, virtual_nodes);
+	}
+
+	void remove_node(const std::string &node){
+		std::unique_lock<std::shared_mutex> guard(ring_lock);
+		ring.remove_node(node);
+	}
+
+	std::string owner(double lat, double lon){
+		std::shared_lock<std::shared_mutex> guard(ring_lock);
+		return ring.owner(local.get_grid().key(lat, lon));
+	}
+
+	// forecast for lat/lon from the owning node
+	forecast_handle _get(double lat, double lon){
+		std::string node = owner(lat, lon);
+		if (node == self)
+			return local._get(lat, lon);
+		try {
+			int64_t fetched_at;
+			if (auto data = decode_tier_value(transport->forward(node, lat, lon), fetched_at))
+				return data;
+		} catch (const std::exception &) {
+		}
+		return local._get(lat, lon);
+	}
+
+	// answers a request forwarded by another node, from the local cache,
+	// with the time the forecast was fetched rather than served
+	std::string serve(double lat, double lon){
+		forecast_clock::time_point fetched_at;
+		auto data = local._get(lat, lon, &fetched_at);
+		return encode_tier_value(*data, forecast_clock::to_time_t(fetched_at));
+	}
+
+	// the source of the pipeline_queries
+	forecast_handle get(double lat, double lon){ return _get(lat, lon); }
+	forecast_metrics &get_metrics(){ return local.get_metrics(); }
+
+	sharded_LFU_cache_client<Policy, Stages, Fetcher> &local_cache() { return local; }
+};
+
+// Fetch, cache and resample as one type queried by location, every stage
+// fixed at compile time: forecast_pipeline over an LFU_cache_client. It is
+// constructed with that client's arguments, source() reaches the cache.
+
+template <template <typename, typename> class Policy = lfu_policy, typename Stages = resample_stage<>,
+	typename Fetcher = forecast_fetcher>
+using cached_pipeline = forecast_pipeline<LFU_cache_client<Policy, Stages, Fetcher>, Stages>;
+
+#endif
@@ -0,0 +1,613 @@
+/*
+ * @file eviction_policies.h
+ *
+ * Eviction policies for policy_cache (see policy_cache.h). A policy is a
+ * class template over the cache's key and hash. The cache embeds the policy's
+ * `node` in every entry, so the policy keeps its ordering with intrusive
+ * links rather than a second map, and tells the cache which node to evict.
+ * Every policy provides:
+ *
+ *		Policy(std::size_t capacity)
+ *		void record(const Key &key)             every lookup, hit or miss
+ *		void on_insert(node &n, const Key &key) key stays valid while cached
+ *		void on_hit(node &n)
+ *		void on_erase(node &n, bool evicted)    evicted is false for erase()
+ *		node *victim(const Key *incoming)       only called while non-empty
+ *		void for_each_hottest(F f)              f(node &) returns false to stop
+ *		void clear()                            the cache destroys the nodes
+ *		void resize(std::size_t capacity)       the entries expected changed
+ *
+ * Policies:
+ *	lru_policy        least recently used
+ *	lfu_policy        least frequently used, ties to the oldest, O(1)
+ *	aging_lfu_policy  lfu_policy whose frequencies are halved periodically
+ *	w_tinylfu_policy  LRU window in front of a segmented LRU, admission to
+ *	                  the main space decided by a count-min sketch
+ *	arc_policy        adaptive replacement cache
+ */
+#ifndef EVICTION_POLICIES_H
+#define EVICTION_POLICIES_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "pool_allocator.h"
+
+namespace detail {
+
+struct list_node {
+	list_node *prev = nullptr, *next = nullptr;
+};
+
+// doubly-linked list of nodes owned elsewhere, head is the least recent
+
+class intrusive_list {
+	list_node *first = nullptr, *last = nullptr;
+	std::size_t count = 0;
+
+	public:
+
+	void push_back(list_node &n){
+		n.prev = last;
+		n.next = nullptr;
+		if (last)
+			last->next = &n;
+		else
+			first = &n;
+		last = &n;
+		count++;
+	}
+
+	void remove(list_node &n){
+		if (n.prev)
+			n.prev->next = n.next;
+		else
+			first = n.next;
+		if (n.next)
+			n.next->prev = n.prev;
+		else
+			last = n.prev;
+		n.prev = n.next = nullptr;
+		count--;
+	}
+
+	void move_to_back(list_node &n){
+		remove(n);
+		push_back(n);
+	}
+
+	list_node *head() const { return first; }
+	list_node *tail() const { return last; }
+	std::size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	void clear() { first = last = nullptr; count = 0; }
+
+	// calls f(node) from most to least recent until it returns false
+	template <typename Node, typename F>
+	bool each_recent(F &f) const {
+		for (list_node *n = last; n; n = n->prev)
+			if (!f(static_cast<Node &>(*n)))
+				return false;
+		return true;
+	}
+};
+
+// Frequency estimates for TinyLFU: four rows of saturating 4-bit counters
+// (stored a byte each). Once 10 * capacity increments have been counted all
+// counters are halved, so the estimate follows recent popularity.
+
+template <typename Key, typename Hash>
+class count_min_sketch {
+	static const int DEPTH = 4;
+	static const uint8_t MAX_COUNT = 15;
+
+	std::vector<uint8_t> counters;
+	std::size_t width_mask;
+	std::size_t additions = 0, sample_size;
+
+	std::size_t _slot(std::size_t hash, int row) const {
+		uint64_t x = (uint64_t)hash + (uint64_t)(row + 1) * 0x9e3779b97f4a7c15ULL;
+		x ^= x >> 32;
+		x *= 0xd6e8feb86659fd93ULL;
+		x ^= x >> 32;
+		return row * (width_mask + 1) + (x & width_mask);
+	}
+
+	public:
+
+	count_min_sketch(std::size_t capacity){
+		std::size_t width = 16;
+		while (width < capacity)
+			width <<= 1;
+		counters.assign(DEPTH * width, 0);
+		width_mask = width - 1;
+		sample_size = std::max<std::size_t>(10 * capacity, 16);
+	}
+
+	void add(const Key &key){
+		std::size_t hash = Hash()(key);
+		for (int row = 0; row < DEPTH; row++) {
+			uint8_t &counter = counters[_slot(hash, row)];
+			if (counter < MAX_COUNT)
+				counter++;
+		}
+		if (++additions >= sample_size) {
+			for (auto &counter : counters)
+				counter >>= 1;
+			additions /= 2;
+		}
+	}
+
+	unsigned int estimate(const Key &key) const {
+		std::size_t hash = Hash()(key);
+		unsigned int least = MAX_COUNT;
+		for (int row = 0; row < DEPTH; row++)
+			least = std::min<unsigned int>(least, counters[_slot(hash, row)]);
+		return least;
+	}
+
+	void clear(){
+		std::fill(counters.begin(), counters.end(), 0);
+		additions = 0;
+	}
+};
+
+}
+
+template <typename Key, typename Hash>
+class lru_policy {
+
+	detail::intrusive_list recency;
+
+	public:
+
+	struct node : detail::list_node {};
+
+	lru_policy(std::size_t) {};
+	void resize(std::size_t) {}
+
+	void record(const Key &) {}
+	void on_insert(node &n, const Key &) { recency.push_back(n); }
+	void on_hit(node &n) { recency.move_to_back(n); }
+	void on_erase(node &n, bool) { recency.remove(n); }
+	node *victim(const Key *) { return static_cast<node *>(recency.head()); }
+
+	template <typename F>
+	void for_each_hottest(F f) { recency.template each_recent<node>(f); }
+
+	void clear() { recency.clear(); }
+};
+
+/*
+ * Constant time LFU. Every node is threaded onto an intrusive list owned by
+ * the bucket for its current frequency, and the buckets form a doubly-linked
+ * list sorted by increasing frequency:
+ *
+ *		lowest
+ *		  |
+ *		  V
+ *		[frequency = 1] <-> [frequency = 2] <-> ... <-> [frequency = n]
+ *		  |                   |
+ *		  V                   V
+ *		oldest <-> ... <-> newest
+ *
+ * A hit moves the node to the tail of the bucket for frequency + 1 (creating
+ * it next to the current bucket if needed), and the victim is the head of the
+ * lowest bucket, so a tie between entries of the lowest frequency goes to the
+ * one that reached that frequency first.
+ *
+ * With Aging, every 10 * capacity accesses all frequencies are halved
+ * (never below 1), merging buckets that end up equal, lower one first. A
+ * formerly hot entry then loses its lead unless it keeps being used. The
+ * pass is linear in the number of buckets and entries, so it is O(1)
+ * amortized per access.
+ */
+
+template <typename Key, typename Hash, bool Aging>
+class basic_lfu_policy {
+
+	struct bucket;
+
+	public:
+
+	struct node {
+		bucket *owner = nullptr;
+		node *prev = nullptr, *next = nullptr;
+	};
+
+	private:
+
+	struct bucket {
+		unsigned int frequency;
+		node *head = nullptr, *tail = nullptr; // head is the oldest node
+		bucket *prev = nullptr, *next = nullptr;
+
+		bucket(unsigned int frequency) : frequency(frequency) {};
+	};
+
+	detail::slab_pool buckets{sizeof(bucket)}; // emptied buckets are recycled from here
+	bucket *lowest = nullptr; // bucket list head, smallest frequency
+	bucket *highest = nullptr; // bucket list tail, largest frequency
+	std::size_t accesses = 0, aging_period;
+
+	// creates an empty bucket for frequency and links it after prev
+	// (or at the front of the list when prev is null)
+
+	bucket *_new_bucket(unsigned int frequency, bucket *prev){
+		bucket *b = new (buckets.allocate()) bucket(frequency);
+		b->prev = prev;
+		b->next = prev ? prev->next : lowest;
+		if (b->next)
+			b->next->prev = b;
+		else
+			highest = b;
+		if (prev)
+			prev->next = b;
+		else
+			lowest = b;
+		return b;
+	}
+
+	void _free_bucket(bucket *b){
+		if (b->prev)
+			b->prev->next = b->next;
+		else
+			lowest = b->next;
+		if (b->next)
+			b->next->prev = b->prev;
+		else
+			highest = b->prev;
+		b->~bucket();
+		buckets.deallocate(b);
+	}
+
+	// appends n to the tail (newest end) of bucket b
+
+	void _link(node &n, bucket *b){
+		n.owner = b;
+		n.prev = b->tail;
+		n.next = nullptr;
+		if (b->tail)
+			b->tail->next = &n;
+		else
+			b->head = &n;
+		b->tail = &n;
+	}
+
+	// removes n from its bucket, dropping the bucket once it is empty
+
+	void _unlink(node &n){
+		bucket *b = n.owner;
+		if (n.prev)
+			n.prev->next = n.next;
+		else
+			b->head = n.next;
+		if (n.next)
+			n.next->prev = n.prev;
+		else
+			b->tail = n.prev;
+		n.owner = nullptr;
+		n.prev = n.next = nullptr;
+		if (!b->head)
+			_free_bucket(b);
+	}
+
+	void _age(){
+		if (!Aging || ++accesses < aging_period)
+			return;
+		accesses = 0;
+		for (bucket *b = lowest; b;) {
+			bucket *next = b->next;
+			b->frequency = std::max(1u, b->frequency / 2);
+			bucket *prev = b->prev;
+			if (prev && prev->frequency == b->frequency) {
+				for (node *n = b->head; n; n = n->next)
+					n->owner = prev;
+				prev->tail->next = b->head;
+				b->head->prev = prev->tail;
+				prev->tail = b->tail;
+				b->head = b->tail = nullptr;
+				_free_bucket(b);
+			}
+			b = next;
+		}
+	}
+
+	public:
+
+	basic_lfu_policy(std::size_t capacity)
+		: aging_period(std::max<std::size_t>(10 * capacity, 16)) {};
+	basic_lfu_policy(const basic_lfu_policy &) = delete;
+	basic_lfu_policy &operator=(const basic_lfu_policy &) = delete;
+	~basic_lfu_policy() { clear(); }
+
+	void resize(std::size_t capacity) { aging_period = std::max<std::size_t>(10 * capacity, 16); }
+
+	void record(const Key &) {}
+
+	void on_insert(node &n, const Key &){
+		bucket *first = lowest;
+		if (!first || first->frequency != 1)
+			first = _new_bucket(1, nullptr);
+		_link(n, first);
+		_age();
+	}
+
+	void on_hit(node &n){
+		bucket *b = n.owner;
+		bucket *target = b->next;
+		if (!target || target->frequency != b->frequency + 1)
+			target = _new_bucket(b->frequency + 1, b);
+		_unlink(n);
+		_link(n, target);
+		_age();
+	}
+
+	void on_erase(node &n, bool) { _unlink(n); }
+
+	node *victim(const Key *) { return lowest ? lowest->head : nullptr; }
+
+	unsigned int frequency(const node &n) const { return n.owner->frequency; }
+
+	// most frequently used first, most recently promoted first within a frequency
+	template <typename F>
+	void for_each_hottest(F f){
+		for (bucket *b = highest; b; b = b->prev)
+			for (node *n = b->tail; n; n = n->prev)
+				if (!f(*n))
+					return;
+	}
+
+	void clear(){
+		while (lowest)
+			_free_bucket(lowest);
+		accesses = 0;
+	}
+};
+
+template <typename Key, typename Hash>
+using lfu_policy = basic_lfu_policy<Key, Hash, false>;
+
+template <typename Key, typename Hash>
+using aging_lfu_policy = basic_lfu_policy<Key, Hash, true>;
+
+/*
+ * W-TinyLFU. New entries go to a small LRU window (1% of the capacity). What
+ * falls out of the window becomes a candidate for the main space, a
+ * segmented LRU of a probation segment and a protected segment (80% of the
+ * main space) that probation entries are promoted to on a hit. When the cache
+ * is full the candidate is only admitted if the sketch has seen it more often
+ * than the main space's eviction victim, otherwise the candidate itself is
+ * evicted. Every lookup, hit or miss, is counted in the sketch.
+ */
+
+template <typename Key, typename Hash>
+class w_tinylfu_policy {
+
+	enum segment : uint8_t { window, probation, protect };
+
+	public:
+
+	struct node : detail::list_node {
+		const Key *key = nullptr;
+		segment where = window;
+	};
+
+	private:
+
+	detail::count_min_sketch<Key, Hash> sketch;
+	detail::intrusive_list lists[3];
+	std::size_t window_size, protected_size;
+
+	static node &_node(detail::list_node *n) { return static_cast<node &>(*n); }
+
+	void _move(node &n, segment to){
+		lists[n.where].remove(n);
+		n.where = to;
+		lists[to].push_back(n);
+	}
+
+	void _size(std::size_t capacity){
+		window_size = std::max<std::size_t>(1, capacity / 100);
+		std::size_t main_size = capacity > window_size ? capacity - window_size : 0;
+		protected_size = main_size * 8 / 10;
+	}
+
+	public:
+
+	w_tinylfu_policy(std::size_t capacity) : sketch(capacity) { _size(capacity); }
+
+	// resizes the segments, overflow moving to probation; the sketch starts over
+	void resize(std::size_t capacity){
+		sketch = detail::count_min_sketch<Key, Hash>(capacity);
+		_size(capacity);
+		while (lists[window].size() > window_size)
+			_move(_node(lists[window].head()), probation);
+		while (lists[protect].size() > protected_size)
+			_move(_node(lists[protect].head()), probation);
+	}
+
+	void record(const Key &key) { sketch.add(key); }
+
+	void on_insert(node &n, const Key &key){
+		n.key = &key;
+		n.where = window;
+		lists[window].push_back(n);
+		while (lists[window].size() > window_size)
+			_move(_node(lists[window].head()), probation);
+	}
+
+	void on_hit(node &n){
+		if (n.where == window) {
+			lists[window].move_to_back(n);
+		} else if (n.where == probation) {
+			_move(n, protect);
+			if (lists[protect].size() > protected_size)
+				_move(_node(lists[protect].head()), probation);
+		} else {
+			lists[protect].move_to_back(n);
+		}
+	}
+
+	void on_erase(node &n, bool) { lists[n.where].remove(n); }
+
+	node *victim(const Key *){
+		detail::list_node *candidate = lists[window].size() >= window_size ? lists[window].head() : nullptr;
+		detail::list_node *main = lists[probation].head() ? lists[probation].head() : lists[protect].head();
+		if (!candidate)
+			return &_node(main ? main : lists[window].head());
+		if (!main)
+			return &_node(candidate);
+		bool admit = sketch.estimate(*_node(candidate).key) > sketch.estimate(*_node(main).key);
+		return &_node(admit ? main : candidate);
+	}
+
+	template <typename F>
+	void for_each_hottest(F f){
+		lists[protect].template each_recent<node>(f) &&
+			lists[probation].template each_recent<node>(f) &&
+			lists[window].template each_recent<node>(f);
+	}
+
+	void clear(){
+		for (auto &list : lists)
+			list.clear();
+		sketch.clear();
+	}
+};
+
+/*
+ * ARC (Megiddo and Modha). Resident entries are split between T1, seen once
+ * recently, and T2, seen at least twice. Keys evicted from either are
+ * remembered in the ghost lists B1 and B2. A miss on a B1 ghost means T1 was
+ * too small and grows its target size p, a miss on a B2 ghost shrinks it.
+ * The victim comes from T1 while it is over p, from T2 otherwise.
+ */
+
+template <typename Key, typename Hash>
+class arc_policy {
+
+	public:
+
+	struct node : detail::list_node {
+		const Key *key = nullptr;
+		bool frequent = false; // in T2
+	};
+
+	private:
+
+	typedef std::list<Key, detail::pool_allocator<Key>> ghost_list; // front is the least recent
+	typedef std::pair<bool, typename ghost_list::iterator> ghost; // in B2?, position
+	typedef detail::pool_allocator<std::pair<const Key, ghost>> ghost_allocator;
+
+	std::size_t capacity;
+	std::size_t target = 0; // p, the size T1 aims for
+	detail::intrusive_list t1, t2;
+	detail::pool_allocator<Key> ghost_slots; // ghost records churn with every eviction
+	ghost_list b1{ghost_slots}, b2{ghost_slots};
+	std::unordered_map<Key, ghost, Hash, std::equal_to<Key>, ghost_allocator> ghosts{0, Hash(), std::equal_to<Key>(), ghost_slots};
+	bool adapted = false; // target already adjusted for the key being inserted
+
+	void _adapt(bool in_b2){
+		if (in_b2) {
+			std::size_t delta = std::max<std::size_t>(1, b1.size() / std::max<std::size_t>(1, b2.size()));
+			target = target > delta ? target - delta : 0;
+		} else {
+			std::size_t delta = std::max<std::size_t>(1, b2.size() / std::max<std::size_t>(1, b1.size()));
+			target = std::min(capacity, target + delta);
+		}
+		adapted = true;
+	}
+
+	void _forget(ghost_list &list){
+		ghosts.erase(list.front());
+		list.pop_front();
+	}
+
+	void _trim(){
+		while (t1.size() + b1.size() > capacity && !b1.empty())
+			_forget(b1);
+		while (t1.size() + t2.size() + b1.size() + b2.size() > 2 * capacity && !b2.empty())
+			_forget(b2);
+	}
+
+	public:
+
+	arc_policy(std::size_t capacity) : capacity(capacity) {};
+
+	void resize(std::size_t size){
+		capacity = size;
+		target = std::min(target, capacity);
+		_trim();
+	}
+
+	void record(const Key &) {}
+
+	void on_insert(node &n, const Key &key){
+		n.key = &key;
+		auto ghost = ghosts.find(key);
+		n.frequent = ghost != ghosts.end();
+		if (n.frequent) {
+			if (!adapted)
+				_adapt(ghost->second.first);
+			(ghost->second.first ? b2 : b1).erase(ghost->second.second);
+			ghosts.erase(ghost);
+		}
+		adapted = false;
+		(n.frequent ? t2 : t1).push_back(n);
+		_trim();
+	}
+
+	void on_hit(node &n){
+		(n.frequent ? t2 : t1).remove(n);
+		n.frequent = true;
+		t2.push_back(n);
+	}
+
+	void on_erase(node &n, bool evicted){
+		(n.frequent ? t2 : t1).remove(n);
+		if (!evicted)
+			return;
+		ghost_list &list = n.frequent ? b2 : b1;
+		list.push_back(*n.key);
+		ghosts[*n.key] = std::make_pair(n.frequent, std::prev(list.end()));
+		_trim();
+	}
+
+	node *victim(const Key *incoming){
+		bool in_b2 = false;
+		if (incoming) {
+			auto ghost = ghosts.find(*incoming);
+			if (ghost != ghosts.end()) {
+				in_b2 = ghost->second.first;
+				if (!adapted)
+					_adapt(in_b2);
+			}
+		}
+		bool from_t1 = !t1.empty() &&
+			(t1.size() > target || (in_b2 && t1.size() == target) || t2.empty());
+		return static_cast<node *>(from_t1 ? t1.head() : t2.head());
+	}
+
+	template <typename F>
+	void for_each_hottest(F f){
+		t2.template each_recent<node>(f) && t1.template each_recent<node>(f);
+	}
+
+	void clear(){
+		t1.clear();
+		t2.clear();
+		b1.clear();
+		b2.clear();
+		ghosts.clear();
+		target = 0;
+		adapted = false;
+	}
+};
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * @file forecast_fetcher.h
+ *
+ * Fetch layer shared by the clients. forecast_fetcher is the asynchronous
+ * interface: a request for a lat/lon completes with the parsed forecast (or
+ * an exception) through a callback, a future, or by blocking.
+ *
+ * http_forecast_fetcher is the implementation talking to the weather
+ * service. It runs a fixed number of worker threads, each owning one
+ * RestClient::Connection, so the curl handle and its keep-alive connection
+ * are reused across requests instead of being set up for every miss, and the
+ * number of requests in flight never exceeds the number of connections.
+ * Requests beyond that queue up. Responses are parsed on the worker too.
+ */
+#ifndef FORECAST_FETCHER_H
+#define FORECAST_FETCHER_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "restclient-cpp/restclient.h"
+#include "restclient-cpp/connection.h"
+#include "forecast_index.h"
+#include "forecast_parser.h"
+#include "metrics.h"
+
+class forecast_fetcher {
+
+	public:
+
+	typedef std::function<void(forecast_handle, std::exception_ptr)> callback;
+
+	virtual ~forecast_fetcher() {}
+
+	// starts fetching the forecast for lat/lon, done is called exactly once
+	// with either the forecast or the exception that stopped it, on
+	// whichever thread completed the request
+	virtual void fetch_async(double lat, double lon, callback done) = 0;
+
+	std::future<forecast_handle> fetch_future(double lat, double lon){
+		auto result = std::make_shared<std::promise<forecast_handle>>();
+		auto future = result->get_future();
+		fetch_async(lat, lon, [result](forecast_handle data, std::exception_ptr error) {
+			if (error)
+				result->set_exception(error);
+			else
+				result->set_value(std::move(data));
+		});
+		return future;
+	}
+
+	forecast_handle fetch(double lat, double lon){
+		return fetch_future(lat, lon).get();
+	}
+
+	// process-wide http fetcher used when a client is not given one
+	static std::shared_ptr<forecast_fetcher> shared();
+};
+
+struct fetcher_options {
+	unsigned int max_connections = 8; // worker threads, each with one persistent connection
+	int timeout_seconds = 10;         // per request, 0 waits indefinitely
+	std::shared_ptr<forecast_metrics> metrics = forecast_metrics::global(); // fetch and parse latencies
+};
+
+class http_forecast_fetcher : public forecast_fetcher {
+
+	struct job {
+		double lat, lon;
+		callback done;
+	};
+
+	fetcher_options options;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<job> queue;
+	bool stopping = false;
+	std::vector<std::thread> workers;
+
+	void _work(){
+		RestClient::Connection connection("");
+		connection.SetTimeout(options.timeout_seconds);
+		for (;;) {
+			job next;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [&]() { return stopping || !queue.empty(); });
+				if (queue.empty())
+					return;
+				next = std::move(queue.front());
+				queue.pop_front();
+			}
+			forecast_handle data;
+			std::exception_ptr error;
+			try {
+				RestClient::Response r;
+				{
+					scoped_timer timer(options.metrics->fetch);
+					r = connection.get(forecast_url(next.lat, next.lon));
+				}
+				if (r.code < 200 || r.code >= 300)
+					throw std::runtime_error("forecast request failed with status " + std::to_string(r.code));
+				scoped_timer timer(options.metrics->parse);
+				data = std::make_shared<const forecast_index>(parse_forecast(r.body));
+			} catch (...) {
+				error = std::current_exception();
+			}
+			next.done(std::move(data), error);
+		}
+	}
+
+	public:
+
+	http_forecast_fetcher(fetcher_options options = fetcher_options()) : options(options) {
+		RestClient::init();
+		unsigned int count = options.max_connections ? options.max_connections : 1;
+		for (unsigned int i = 0; i < count; i++)
+			workers.emplace_back(&http_forecast_fetcher::_work, this);
+	}
+
+	// finishes the queued requests before returning
+	~http_forecast_fetcher(){
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+		RestClient::disable();
+	}
+
+	static std::string forecast_url(double lat, double lon){
+		std::ostringstream oss;
+		oss << "http://REDACTED"
+			<< lat
+			<< "&lon="
+			<< lon;
+		return oss.str();
+	}
+
+	void fetch_async(double lat, double lon, callback done) override {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			queue.push_back({lat, lon, std::move(done)});
+		}
+		wake.notify_one();
+	}
+};
+
+inline std::shared_ptr<forecast_fetcher> forecast_fetcher::shared(){
+	static std::shared_ptr<forecast_fetcher> instance = std::make_shared<http_forecast_fetcher>();
+	return instance;
+}
+
+#endif
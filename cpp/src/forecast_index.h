@@ -0,0 +1,497 @@
+/*
+ * @file forecast_index.h
+ *
+ * Flat time index over a five day forecast and the resampling used by
+ * query(). The forecast is a few dozen points with increasing `dt`, so it is
+ * kept as flat arrays instead of a tree. The requested sample grid is
+ * monotone as well, so resampling walks the forecast segments once and
+ * writes the samples inside each segment as a run, using AVX2 or NEON when
+ * the build enables them.
+ *
+ * The index is what the caches hold, so it is stored compactly. The service
+ * spaces points evenly (every three hours), which leaves just a first dt and
+ * a step; a timestamp array is only kept when the spacing is irregular.
+ * Temperatures come with two decimals and are stored as 16-bit hundredths
+ * above the smallest one, decoded exactly with one add and one divide; values
+ * that do not round trip that way are kept as doubles instead. A 40 point
+ * forecast takes 80 bytes of data rather than 480.
+ *
+ * Besides the temperature, an index can carry humidity, wind speed and
+ * precipitation probability columns over the same time index, all packed the
+ * same way. resample_metrics() samples any set of them in one walk over the
+ * segments.
+ */
+#ifndef FORECAST_INDEX_H
+#define FORECAST_INDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+const int TWO_HOURS = 2 * 60 * 60;
+const int ONE_DAY = 24 * 60 * 60;
+const int MINUTE = 60;
+const int FIVE_MINUTES = 5 * 60;
+const int ONE_HOUR = 60 * 60;
+
+// set of forecast metrics, one bit each
+typedef unsigned int metric_mask;
+
+namespace metric {
+
+const metric_mask temperature = 1;   // kelvin, main.temp
+const metric_mask humidity = 2;      // percent, main.humidity
+const metric_mask wind_speed = 4;    // metres per second, wind.speed
+const metric_mask precipitation = 8; // probability from 0 to 1, pop
+const metric_mask all = 15;
+
+}
+
+namespace detail {
+
+// native byte order field I/O for the binary encoding of an index
+
+template <typename T>
+void put_field(std::string &out, const T &value){
+	out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+bool get_field(const char *&p, const char *end, T &value){
+	if ((std::size_t)(end - p) < sizeof(value))
+		return false;
+	std::memcpy(&value, p, sizeof(value));
+	p += sizeof(value);
+	return true;
+}
+
+template <typename T>
+bool get_fields(const char *&p, const char *end, std::vector<T> &values, std::size_t count){
+	if ((std::size_t)(end - p) / sizeof(T) < count)
+		return false;
+	values.resize(count);
+	std::memcpy(values.data(), p, count * sizeof(T));
+	p += count * sizeof(T);
+	return true;
+}
+
+// A column of values stored as 16-bit hundredths above base when every value
+// has at most two decimals and they span less than 655.36, as doubles otherwise
+
+class packed_column {
+	int64_t base = 0;
+	std::vector<uint16_t> hundredths;
+	std::vector<double> wide;
+
+	static bool _packs(double v, int64_t &q){
+		if (!std::isfinite(v) || std::fabs(v) > 1e12)
+			return false;
+		q = std::llround(v * 100.0);
+		return (double)q / 100.0 == v;
+	}
+
+	public:
+
+	packed_column() {};
+
+	explicit packed_column(const std::vector<double> &values){
+		std::vector<int64_t> q(values.size());
+		bool packs = true;
+		for (std::size_t k = 0; k < values.size() && packs; k++)
+			packs = _packs(values[k], q[k]);
+		if (packs && !q.empty()) {
+			auto range = std::minmax_element(q.begin(), q.end());
+			packs = *range.second - *range.first <= UINT16_MAX;
+			base = *range.first;
+		}
+		if (!packs) {
+			wide = values;
+			return;
+		}
+		hundredths.reserve(q.size());
+		for (int64_t v : q)
+			hundredths.push_back((uint16_t)(v - base));
+	}
+
+	double operator[](std::size_t k) const {
+		return wide.empty() ? (double)(base + hundredths[k]) / 100.0 : wide[k];
+	}
+
+	bool packed() const { return wide.empty(); }
+
+	// appends the column as stored, read back by decode() given its length
+	void encode(std::string &out) const {
+		put_field(out, (uint8_t)packed());
+		if (packed()) {
+			put_field(out, base);
+			out.append(reinterpret_cast<const char *>(hundredths.data()), hundredths.size() * sizeof(uint16_t));
+		} else {
+			out.append(reinterpret_cast<const char *>(wide.data()), wide.size() * sizeof(double));
+		}
+	}
+
+	bool decode(const char *&p, const char *end, std::size_t count){
+		uint8_t is_packed;
+		if (!get_field(p, end, is_packed))
+			return false;
+		hundredths.clear();
+		wide.clear();
+		if (!is_packed)
+			return get_fields(p, end, wide, count);
+		return get_field(p, end, base) && get_fields(p, end, hundredths, count);
+	}
+
+	std::size_t heap_bytes() const { return hundredths.capacity() * sizeof(uint16_t) + wide.capacity() * sizeof(double); }
+};
+
+}
+
+class forecast_index {
+	std::size_t count = 0;
+	int32_t first_dt = 0, step = 0; // dt of point k is first_dt + k * step when step is set
+	std::vector<int32_t> dts;       // the timestamps when they are not evenly spaced
+	detail::packed_column temps;
+	metric_mask extra = 0;          // metrics carried besides the temperature
+	std::vector<detail::packed_column> extras; // their columns, in metric bit order
+
+	// position of metric m's column in extras
+	std::size_t _slot(metric_mask m) const { return (std::size_t)__builtin_popcount(extra & (m - 1)); }
+
+	public:
+
+	forecast_index() {};
+
+	// dt must be increasing, temp[k] was observed at dt[k]
+	forecast_index(const std::vector<int32_t> &dt, const std::vector<double> &temp)
+		: count(dt.size()), temps(temp) {
+		if (dt.empty())
+			return;
+		first_dt = dt[0];
+		step = dt.size() > 1 ? dt[1] - dt[0] : 1;
+		for (std::size_t k = 2; k < dt.size() && step; k++)
+			if (dt[k] - dt[k - 1] != step)
+				step = 0;
+		if (!step)
+			dts = dt;
+	}
+
+	std::size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	int32_t time(std::size_t k) const { return step ? first_dt + (int32_t)k * step : dts[k]; }
+	double temperature(std::size_t k) const { return temps[k]; }
+	int32_t first_time() const { return time(0); }
+	int32_t last_time() const { return time(count - 1); }
+
+	// the metrics this index has a column for
+	metric_mask metrics() const { return metric::temperature | extra; }
+
+	// column of metric m (a single metric), null if the index does not carry it
+	const detail::packed_column *column(metric_mask m) const {
+		if (m == metric::temperature)
+			return &temps;
+		return (extra & m) && !(m & (m - 1)) ? &extras[_slot(m)] : nullptr;
+	}
+
+	// Adds (or replaces) the column of metric m, values[k] being the value
+	// at time(k). Throws std::invalid_argument for the temperature, which is
+	// given to the constructor, an unknown metric or a length other than size().
+
+	void set_metric(metric_mask m, const std::vector<double> &values){
+		if (m == metric::temperature || !(m & metric::all) || (m & (m - 1)) || values.size() != count)
+			throw std::invalid_argument("forecast metric column does not fit the index");
+		if (extra & m) {
+			extras[_slot(m)] = detail::packed_column(values);
+			return;
+		}
+		extras.insert(extras.begin() + _slot(m), detail::packed_column(values));
+		extra |= m;
+	}
+
+	// true when the spacing and every column took the compact form
+	bool compact() const {
+		for (auto &c : extras)
+			if (!c.packed())
+				return false;
+		return step && temps.packed();
+	}
+
+	// heap memory held by the index, including the index itself
+	std::size_t size_bytes() const {
+		std::size_t bytes = sizeof(*this) + dts.capacity() * sizeof(int32_t) + temps.heap_bytes();
+		bytes += extras.capacity() * sizeof(detail::packed_column);
+		for (auto &c : extras)
+			bytes += c.heap_bytes();
+		return bytes;
+	}
+
+	// Appends the index in its compact form: count, first dt and step, the
+	// timestamps only if they are irregular, the packed temperatures, then
+	// the mask of the other metrics and their columns.
+	// Native byte order, for caches shared between hosts of one architecture.
+
+	void encode(std::string &out) const {
+		detail::put_field(out, (uint32_t)count);
+		detail::put_field(out, first_dt);
+		detail::put_field(out, step);
+		if (count && !step)
+			out.append(reinterpret_cast<const char *>(dts.data()), dts.size() * sizeof(int32_t));
+		temps.encode(out);
+		detail::put_field(out, (uint8_t)extra);
+		for (auto &c : extras)
+			c.encode(out);
+	}
+
+	// reads an index written by encode() starting at p, false (with p
+	// anywhere) if the bytes are truncated or inconsistent
+
+	static bool decode(const char *&p, const char *end, forecast_index &index){
+		uint32_t count;
+		if (!detail::get_field(p, end, count) || !detail::get_field(p, end, index.first_dt) ||
+				!detail::get_field(p, end, index.step) || index.step < 0)
+			return false;
+		index.count = count;
+		index.dts.clear();
+		if (count && !index.step) {
+			if (!detail::get_fields(p, end, index.dts, count))
+				return false;
+			for (std::size_t k = 1; k < count; k++)
+				if (index.dts[k - 1] >= index.dts[k])
+					return false;
+		}
+		uint8_t mask;
+		if (!index.temps.decode(p, end, count) || !detail::get_field(p, end, mask) ||
+				(mask & ~(metric::all & ~metric::temperature)))
+			return false;
+		index.extra = mask;
+		index.extras.assign((std::size_t)__builtin_popcount(mask), detail::packed_column());
+		for (auto &c : index.extras)
+			if (!c.decode(p, end, count))
+				return false;
+		return true;
+	}
+
+	// builds the index from (dt, temp) points in any order, keeping the
+	// first point seen for a repeated dt
+
+	static forecast_index from_points(std::vector<std::tuple<int, double>> points){
+		std::stable_sort(points.begin(), points.end(),
+			[](const std::tuple<int, double> &a, const std::tuple<int, double> &b) {
+				return std::get<0>(a) < std::get<0>(b);
+			});
+		std::vector<int32_t> dt;
+		std::vector<double> temp;
+		dt.reserve(points.size());
+		temp.reserve(points.size());
+		for (auto &point : points) {
+			if (!dt.empty() && dt.back() == std::get<0>(point))
+				continue;
+			dt.push_back(std::get<0>(point));
+			temp.push_back(std::get<1>(point));
+		}
+		return forecast_index(dt, temp);
+	}
+};
+
+// time index built once per fetched forecast and shared by cache entries
+typedef std::shared_ptr<const forecast_index> forecast_handle;
+
+// sample spacing used for a requested range
+
+constexpr int granularity_for(int start, int end){
+	auto requested_range = end - start;
+	if (requested_range < TWO_HOURS)
+		return MINUTE;
+	if (requested_range < ONE_DAY)
+		return FIVE_MINUTES;
+	return ONE_HOUR;
+}
+
+enum class resample_mode {
+	nearest, // temperature of the nearest point, the later one on a tie
+	linear   // linear interpolation between the surrounding points
+};
+
+namespace detail {
+
+// out[k] = v for k < n
+
+inline void fill_run(double *out, std::size_t n, double v){
+	std::size_t k = 0;
+#if defined(__AVX2__)
+	const __m256d vv = _mm256_set1_pd(v);
+	for (; k + 4 <= n; k += 4)
+		_mm256_storeu_pd(out + k, vv);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const float64x2_t vv = vdupq_n_f64(v);
+	for (; k + 2 <= n; k += 2)
+		vst1q_f64(out + k, vv);
+#endif
+	for (; k < n; k++)
+		out[k] = v;
+}
+
+// out[k] = base + (offset + k * step) * slope for k < n
+
+inline void lerp_run(double *out, std::size_t n, double base, double offset, double step, double slope){
+	std::size_t k = 0;
+#if defined(__AVX2__)
+	const __m256d vbase = _mm256_set1_pd(base), voffset = _mm256_set1_pd(offset);
+	const __m256d vstep = _mm256_set1_pd(step), vslope = _mm256_set1_pd(slope);
+	const __m256d four = _mm256_set1_pd(4.0);
+	__m256d vk = _mm256_setr_pd(0.0, 1.0, 2.0, 3.0);
+	for (; k + 4 <= n; k += 4) {
+		__m256d t = _mm256_add_pd(voffset, _mm256_mul_pd(vk, vstep));
+		_mm256_storeu_pd(out + k, _mm256_add_pd(vbase, _mm256_mul_pd(t, vslope)));
+		vk = _mm256_add_pd(vk, four);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const float64x2_t vbase = vdupq_n_f64(base), voffset = vdupq_n_f64(offset);
+	const float64x2_t vstep = vdupq_n_f64(step), vslope = vdupq_n_f64(slope);
+	const float64x2_t two = vdupq_n_f64(2.0);
+	float64x2_t vk = {0.0, 1.0};
+	for (; k + 2 <= n; k += 2) {
+		float64x2_t t = vaddq_f64(voffset, vmulq_f64(vk, vstep));
+		vst1q_f64(out + k, vaddq_f64(vbase, vmulq_f64(t, vslope)));
+		vk = vaddq_f64(vk, two);
+	}
+#endif
+	for (; k < n; k++)
+		out[k] = base + (offset + (double)k * step) * slope;
+}
+
+// number of samples start + k * granularity, k < limit, that are <= x
+
+inline std::size_t samples_through(int64_t x, int start, int granularity, std::size_t limit){
+	if (x < start)
+		return 0;
+	return std::min<std::size_t>(limit, (std::size_t)((x - start) / granularity) + 1);
+}
+
+}
+
+// Number of samples resample() produces for [start, end): one every
+// granularity seconds, stopping after the last forecast point.
+
+inline std::size_t resample_count(const forecast_index &index, int start, int end, int granularity){
+	if (index.empty() || end <= start)
+		return 0;
+	std::size_t in_range = (std::size_t)(((int64_t)end - start + granularity - 1) / granularity);
+	return detail::samples_through(index.last_time(), start, granularity, in_range);
+}
+
+namespace detail {
+
+// resample_into() over several columns of the index at once, the samples of
+// columns[c] going to out + c * count. The segment bounds are worked out
+// once for all of them.
+
+inline void resample_columns_into(const forecast_index &index, const packed_column *const *columns,
+		std::size_t column_count, int start, int granularity, double *out, std::size_t count,
+		resample_mode mode){
+	if (count == 0)
+		return;
+	const std::size_t n = index.size();
+	int32_t prev_dt = index.time(0);
+	std::size_t done = samples_through(prev_dt, start, granularity, count);
+	for (std::size_t c = 0; c < column_count; c++)
+		fill_run(out + c * count, done, (*columns[c])[0]);
+	for (std::size_t j = 1; j < n && done < count; prev_dt = index.time(j++)) {
+		int32_t dt = index.time(j);
+		std::size_t through = samples_through(dt, start, granularity, count);
+		if (through == done)
+			continue;
+		if (mode == resample_mode::nearest) {
+			// t - prev_dt < dt - t  <=>  t <= (prev_dt + dt - 1) / 2
+			int64_t last_prev = ((int64_t)prev_dt + dt - 1) / 2;
+			std::size_t split = std::max(done, samples_through(last_prev, start, granularity, through));
+			for (std::size_t c = 0; c < column_count; c++) {
+				double *series = out + c * count;
+				fill_run(series + done, split - done, (*columns[c])[j - 1]);
+				fill_run(series + split, through - split, (*columns[c])[j]);
+			}
+		} else {
+			double span = (double)dt - prev_dt;
+			double offset = (double)((int64_t)start + (int64_t)done * granularity - prev_dt);
+			for (std::size_t c = 0; c < column_count; c++) {
+				double prev_value = (*columns[c])[j - 1], value = (*columns[c])[j];
+				lerp_run(out + c * count + done, through - done, prev_value, offset, granularity, (value - prev_value) / span);
+			}
+		}
+		done = through;
+	}
+}
+
+}
+
+// Writes the first count samples starting at start into out. Samples before
+// the first forecast point take the first point's temperature. Rather than
+// searching per sample, every forecast segment is handled once: the samples
+// falling into it form a contiguous run of out that is filled (nearest) or
+// interpolated (linear) by a vector kernel. Points are decoded once per
+// segment, not per sample.
+
+inline void resample_into(const forecast_index &index, int start, int granularity,
+		double *out, std::size_t count, resample_mode mode = resample_mode::nearest){
+	const detail::packed_column *temperature = index.column(metric::temperature);
+	detail::resample_columns_into(index, &temperature, 1, start, granularity, out, count, mode);
+}
+
+// Samples the forecast every granularity seconds over [start, end), see
+// resample_into()
+
+inline std::vector<double> resample(const forecast_index &index, int start, int end, int granularity,
+		resample_mode mode = resample_mode::nearest){
+	std::vector<double> ret(resample_count(index, start, end, granularity));
+	resample_into(index, start, granularity, ret.data(), ret.size(), mode);
+	return ret;
+}
+
+// Several metrics sampled over the same range: each has length samples,
+// stored one series after another in metric bit order.
+
+struct metric_series {
+	metric_mask metrics = 0; // the series present, requested ones the forecast lacks are left out
+	std::size_t length = 0;
+	std::vector<double> values;
+
+	// the samples of metric m, null if it is not present
+	const double *series(metric_mask m) const {
+		if (!(metrics & m) || (m & (m - 1)))
+			return nullptr;
+		return values.data() + (std::size_t)__builtin_popcount(metrics & (m - 1)) * length;
+	}
+};
+
+// resample() for every metric in mask the index carries, in one pass
+
+inline metric_series resample_metrics(const forecast_index &index, metric_mask mask, int start, int end,
+		int granularity, resample_mode mode = resample_mode::nearest){
+	metric_series result;
+	result.metrics = mask & index.metrics();
+	result.length = resample_count(index, start, end, granularity);
+	const detail::packed_column *columns[4];
+	std::size_t column_count = 0;
+	for (metric_mask m = 1; m & metric::all; m <<= 1)
+		if (result.metrics & m)
+			columns[column_count++] = index.column(m);
+	result.values.resize(column_count * result.length);
+	detail::resample_columns_into(index, columns, column_count, start, granularity,
+		result.values.data(), result.length, mode);
+	return result;
+}
+
+#endif
@@ -0,0 +1,233 @@
+/*
+ * @file forecast_parser.h
+ *
+ * Extracts the forecast index from a five day forecast response. Only `cnt`,
+ * `list[].dt`, `list[].main.temp` and the other metrics the index can carry
+ * (`main.humidity`, `wind.speed` and `pop`) are used out of every response,
+ * so instead of building the whole nlohmann DOM the body is run through the
+ * SAX interface and those fields are appended straight into flat arrays the
+ * index is packed from. Nothing else in the payload (weather, clouds, ...)
+ * is materialized.
+ */
+#ifndef FORECAST_PARSER_H
+#define FORECAST_PARSER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "nlohmann/json.hpp"
+#include "forecast_index.h"
+
+namespace detail {
+
+// what the parser collects, one entry per forecast point
+struct forecast_columns {
+	static const std::size_t EXTRA_METRICS = 3;
+	static constexpr metric_mask EXTRA[EXTRA_METRICS] = {metric::humidity, metric::wind_speed, metric::precipitation};
+
+	std::vector<int32_t> dt;
+	std::vector<double> temp;
+	std::vector<double> extra[EXTRA_METRICS]; // in the order of EXTRA
+	metric_mask complete = metric::all;        // metrics every point had
+};
+
+// SAX handler that tracks just enough nesting to recognise the fields
+
+class forecast_sax {
+	enum field { none, cnt, list, dt, main, wind, temp, humidity, speed, pop };
+
+	static const std::size_t MAX_RESERVED_POINTS = 40; // a five day forecast, every three hours
+
+	forecast_columns &columns;
+	std::size_t depth = 0;        // open objects and arrays
+	std::size_t list_depth = 0;   // depth of the list array, 0 outside it
+	std::size_t object_depth = 0; // depth of the current element's main or wind object
+	field object = none;          // which of the two that is
+	field pending = none;         // field the next value belongs to
+	bool have_dt = false;
+	metric_mask have = 0;
+	int64_t element_dt = 0;
+	double element_temp = 0, element_extra[forecast_columns::EXTRA_METRICS] = {};
+
+	bool _in_element() const { return list_depth && depth == list_depth + 1; }
+
+	void _extra(std::size_t i, double value){
+		element_extra[i] = value;
+		have |= forecast_columns::EXTRA[i];
+	}
+
+	void _number(double value){
+		if (pending == cnt && value > 0) {
+			// cnt comes from upstream, reserve no more than a response should hold
+			std::size_t points = (std::size_t)std::min(value, (double)MAX_RESERVED_POINTS);
+			columns.dt.reserve(points);
+			columns.temp.reserve(points);
+		} else if (pending == dt) {
+			element_dt = (int64_t)value;
+			have_dt = true;
+		} else if (pending == temp) {
+			element_temp = value;
+			have |= metric::temperature;
+		} else if (pending == humidity) {
+			_extra(0, value);
+		} else if (pending == speed) {
+			_extra(1, value);
+		} else if (pending == pop) {
+			_extra(2, value);
+		}
+		pending = none;
+	}
+
+	public:
+
+	bool saw_list = false;
+	std::string error;
+
+	forecast_sax(forecast_columns &columns) : columns(columns) {};
+
+	bool null() { pending = none; return true; }
+	bool boolean(bool) { pending = none; return true; }
+	bool number_integer(nlohmann::json::number_integer_t value) { _number((double)value); return true; }
+	bool number_unsigned(nlohmann::json::number_unsigned_t value) { _number((double)value); return true; }
+	bool number_float(nlohmann::json::number_float_t value, const std::string &) { _number(value); return true; }
+	bool string(std::string &) { pending = none; return true; }
+	bool binary(nlohmann::json::binary_t &) { pending = none; return true; }
+
+	bool key(std::string &name){
+		pending = none;
+		if (depth == 1) {
+			if (name == "cnt")
+				pending = cnt;
+			else if (name == "list")
+				pending = list;
+		} else if (_in_element()) {
+			if (name == "dt")
+				pending = dt;
+			else if (name == "main")
+				pending = main;
+			else if (name == "wind")
+				pending = wind;
+			else if (name == "pop")
+				pending = pop;
+		} else if (object_depth && depth == object_depth) {
+			if (object == main && name == "temp")
+				pending = temp;
+			else if (object == main && name == "humidity")
+				pending = humidity;
+			else if (object == wind && name == "speed")
+				pending = speed;
+		}
+		return true;
+	}
+
+	bool start_object(std::size_t){
+		depth++;
+		if ((pending == main || pending == wind) && depth == list_depth + 2) {
+			object_depth = depth;
+			object = pending;
+		} else if (_in_element()) {
+			have_dt = false;
+			have = 0;
+		}
+		pending = none;
+		return true;
+	}
+
+	bool end_object(){
+		if (depth == object_depth) {
+			object_depth = 0;
+			object = none;
+		} else if (_in_element()) {
+			if (!have_dt || !(have & metric::temperature)) {
+				error = "forecast entry without dt or main.temp";
+				return false;
+			}
+			columns.dt.push_back((int32_t)element_dt);
+			columns.temp.push_back(element_temp);
+			for (std::size_t i = 0; i < forecast_columns::EXTRA_METRICS; i++) {
+				columns.extra[i].push_back(element_extra[i]);
+				if (!(have & forecast_columns::EXTRA[i]))
+					columns.complete &= ~forecast_columns::EXTRA[i];
+			}
+		}
+		depth--;
+		return true;
+	}
+
+	bool start_array(std::size_t){
+		depth++;
+		if (pending == list && depth == 2) {
+			list_depth = depth;
+			saw_list = true;
+		}
+		pending = none;
+		return true;
+	}
+
+	bool end_array(){
+		if (depth == list_depth)
+			list_depth = 0;
+		depth--;
+		return true;
+	}
+
+	bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &ex){
+		error = ex.what();
+		return false;
+	}
+};
+
+// reorders every column by increasing dt, keeping the first point seen for a repeated dt
+inline void sort_points(forecast_columns &columns){
+	std::vector<std::size_t> order(columns.dt.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(),
+		[&](std::size_t a, std::size_t b) { return columns.dt[a] < columns.dt[b]; });
+	order.erase(std::unique(order.begin(), order.end(),
+		[&](std::size_t a, std::size_t b) { return columns.dt[a] == columns.dt[b]; }), order.end());
+	auto pick = [&](auto &values) {
+		std::remove_reference_t<decltype(values)> sorted;
+		sorted.reserve(order.size());
+		for (std::size_t k : order)
+			sorted.push_back(values[k]);
+		values.swap(sorted);
+	};
+	pick(columns.dt);
+	pick(columns.temp);
+	for (auto &values : columns.extra)
+		pick(values);
+}
+
+}
+
+// Parses a forecast response body, throws std::runtime_error if it is not
+// valid JSON or has no forecast list. Humidity, wind speed and precipitation
+// probability are added to the index when every point has them.
+
+inline forecast_index parse_forecast(const std::string &body){
+	detail::forecast_columns columns;
+	detail::forecast_sax handler(columns);
+	if (!nlohmann::json::sax_parse(body, &handler))
+		throw std::runtime_error("malformed forecast response: " + handler.error);
+	if (!handler.saw_list)
+		throw std::runtime_error("forecast response has no list");
+	// the service lists points in time order, fall back to sorting if not
+	for (std::size_t k = 1; k < columns.dt.size(); k++) {
+		if (columns.dt[k - 1] >= columns.dt[k]) {
+			detail::sort_points(columns);
+			break;
+		}
+	}
+	forecast_index index(columns.dt, columns.temp);
+	if (!columns.dt.empty())
+		for (std::size_t i = 0; i < detail::forecast_columns::EXTRA_METRICS; i++)
+			if (columns.complete & detail::forecast_columns::EXTRA[i])
+				index.set_metric(detail::forecast_columns::EXTRA[i], columns.extra[i]);
+	return index;
+}
+
+#endif
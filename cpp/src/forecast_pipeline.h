@@ -0,0 +1,213 @@
+/*
+ * @file forecast_pipeline.h
+ *
+ * The query path every client shares, as stages picked at compile time:
+ *
+ *	source      where the indexed forecast for a location comes from,
+ *	            fetch_source fetching it on every query
+ *	granularity sample spacing for a requested range (default_granularity,
+ *	            fixed_granularity<seconds>)
+ *	resampler   turns the index into series (index_resampler)
+ *
+ * Every stage works on forecast_index, the form sources hand out
+ * (forecast_handle); a resampler replaces how it is read, not what.
+ *
+ * Parsing is not a stage of its own: it belongs to the fetcher, which runs
+ * it on its worker threads off the query path (see forecast_fetcher.h).
+ *
+ * resample_stage<Granularity, Resampler> turns a forecast into a result, and
+ * pipeline_queries<Derived, Stages> is the query interface every client
+ * builds on it, over the client's source. forecast_pipeline<Source, Stages>
+ * is that interface over a source it owns. The source is the optional cache
+ * layer: NonCachingClient is a pipeline over a fetch_source, a caching
+ * client is its own source with a fetch_source upstream of its cache (see
+ * cache_clients.h), so every client shares one query path. Stages are plain
+ * classes with static members, so a specialized pipeline costs no virtual
+ * calls, and a fetch_source over a final fetcher type (synthetic_fetcher,
+ * say) calls it directly rather than through forecast_fetcher's vtable.
+ */
+#ifndef FORECAST_PIPELINE_H
+#define FORECAST_PIPELINE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "forecast_fetcher.h"
+#include "forecast_index.h"
+#include "metrics.h"
+
+// the service's spacing, see granularity_for()
+struct default_granularity {
+	static constexpr int for_range(int start, int end){ return granularity_for(start, end); }
+};
+
+// the same spacing whatever the range
+template <int Seconds>
+struct fixed_granularity {
+	static_assert(Seconds > 0, "granularity must be positive");
+	static constexpr int for_range(int, int){ return Seconds; }
+};
+
+// resampling of forecast_index, see resample_into()
+struct index_resampler {
+	static std::size_t count(const forecast_index &index, int start, int end, int granularity){
+		return resample_count(index, start, end, granularity);
+	}
+
+	static void into(const forecast_index &index, int start, int granularity, double *out,
+			std::size_t count, resample_mode mode){
+		resample_into(index, start, granularity, out, count, mode);
+	}
+
+	static metric_series metrics(const forecast_index &index, metric_mask mask, int start, int end,
+			int granularity, resample_mode mode){
+		return resample_metrics(index, mask, start, end, granularity, mode);
+	}
+};
+
+// From an index to query results. Every function records its time into
+// timing, the resample histogram of the client's metrics.
+
+template <typename Granularity = default_granularity, typename Resampler = index_resampler>
+struct resample_stage {
+	static constexpr int granularity(int start, int end){ return Granularity::for_range(start, end); }
+
+	static std::size_t count(const forecast_index &index, int start, int end){
+		return Resampler::count(index, start, end, granularity(start, end));
+	}
+
+	// the first count samples of the series for [start, end), untimed
+	static void into(const forecast_index &index, int start, int end, double *out, std::size_t count,
+			resample_mode mode){
+		Resampler::into(index, start, granularity(start, end), out, count, mode);
+	}
+
+	static std::vector<double> series(const forecast_index &index, int start, int end, resample_mode mode,
+			latency_histogram &timing){
+		scoped_timer timer(timing);
+		int step = granularity(start, end);
+		std::vector<double> values(Resampler::count(index, start, end, step));
+		Resampler::into(index, start, step, values.data(), values.size(), mode);
+		return values;
+	}
+
+	// writes at most capacity samples, returns the length of the full series
+	static std::size_t series_into(const forecast_index &index, int start, int end, double *out,
+			std::size_t capacity, resample_mode mode, latency_histogram &timing){
+		scoped_timer timer(timing);
+		int step = granularity(start, end);
+		std::size_t length = Resampler::count(index, start, end, step);
+		Resampler::into(index, start, step, out, std::min(length, capacity), mode);
+		return length;
+	}
+
+	static metric_series metrics(const forecast_index &index, metric_mask mask, int start, int end,
+			resample_mode mode, latency_histogram &timing){
+		scoped_timer timer(timing);
+		return Resampler::metrics(index, mask, start, end, granularity(start, end), mode);
+	}
+};
+
+// Source that fetches on every call, and the upstream of the caching
+// clients. With a final Fetcher the request is made without a virtual call.
+
+template <typename Fetcher = forecast_fetcher>
+class fetch_source {
+	std::shared_ptr<Fetcher> fetcher;
+	std::shared_ptr<forecast_metrics> metrics = forecast_metrics::global();
+
+	public:
+
+	typedef Fetcher fetcher_type;
+
+	fetch_source(std::shared_ptr<Fetcher> fetcher) : fetcher(std::move(fetcher)) {};
+
+	void get_async(double lat, double lon, forecast_fetcher::callback done){
+		if constexpr (std::is_final<Fetcher>::value)
+			fetcher->Fetcher::fetch_async(lat, lon, std::move(done));
+		else
+			fetcher->fetch_async(lat, lon, std::move(done));
+	}
+
+	std::future<forecast_handle> get_future(double lat, double lon){
+		auto result = std::make_shared<std::promise<forecast_handle>>();
+		auto future = result->get_future();
+		get_async(lat, lon, [result](forecast_handle data, std::exception_ptr error) {
+			if (error)
+				result->set_exception(error);
+			else
+				result->set_value(std::move(data));
+		});
+		return future;
+	}
+
+	forecast_handle get(double lat, double lon){
+		std::promise<forecast_handle> result;
+		auto future = result.get_future();
+		get_async(lat, lon, [&result](forecast_handle data, std::exception_ptr error) {
+			if (error)
+				result.set_exception(error);
+			else
+				result.set_value(std::move(data));
+		});
+		return future.get();
+	}
+
+	void set_metrics(std::shared_ptr<forecast_metrics> sink){ metrics = std::move(sink); }
+	forecast_metrics &get_metrics(){ return *metrics; }
+};
+
+// The queries of a pipeline, mixed into Derived, which provides
+// get(lat, lon), returning a handle to the index for a location, and
+// get_metrics(), whose resample histogram times the stages.
+
+template <typename Derived, typename Stages>
+class pipeline_queries {
+	Derived &_self(){ return static_cast<Derived &>(*this); }
+
+	public:
+
+	std::vector<double> query(double lat, double lon, int start, int end,
+			resample_mode mode = resample_mode::nearest){
+		auto data = _self().get(lat, lon);
+		return Stages::series(*data, start, end, mode, _self().get_metrics().resample);
+	}
+
+	// writes at most capacity samples into out, returns the full length of the series
+	std::size_t query(double lat, double lon, int start, int end, double *out, std::size_t capacity,
+			resample_mode mode = resample_mode::nearest){
+		auto data = _self().get(lat, lon);
+		return Stages::series_into(*data, start, end, out, capacity, mode, _self().get_metrics().resample);
+	}
+
+	metric_series query_metrics(double lat, double lon, metric_mask mask, int start, int end,
+			resample_mode mode = resample_mode::nearest){
+		auto data = _self().get(lat, lon);
+		return Stages::metrics(*data, mask, start, end, mode, _self().get_metrics().resample);
+	}
+};
+
+// A source it owns followed by the resampling stages. Source provides
+// get(lat, lon) and get_metrics() as above.
+
+template <typename Source, typename Stages = resample_stage<>>
+class forecast_pipeline : public pipeline_queries<forecast_pipeline<Source, Stages>, Stages> {
+	Source input;
+
+	public:
+
+	template <typename... Args>
+	explicit forecast_pipeline(Args &&...args) : input(std::forward<Args>(args)...) {};
+
+	Source &source(){ return input; }
+
+	forecast_handle get(double lat, double lon){ return input.get(lat, lon); }
+	forecast_metrics &get_metrics(){ return input.get_metrics(); }
+};
+
+#endif
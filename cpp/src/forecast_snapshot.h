@@ -0,0 +1,246 @@
+/*
+ * @file forecast_snapshot.h
+ *
+ * Snapshot file for warm starts. A client writes the forecasts it holds to
+ * a snapshot before it goes away; the next process maps the file and serves
+ * misses out of it, so a restart does not have to refetch every location.
+ * Opening only checks the header and the record table; a record is decoded
+ * into an index when its location is first missed.
+ *
+ * The layout is fixed, native byte order:
+ *
+ *		header                      see snapshot_header
+ *		record[count]               sorted by key, see snapshot_record
+ *		data                        per record, int32 dt[points], double temp[points],
+ *		                            then double[points] for each of its other metrics
+ *
+ * A file whose magic, byte order mark, version, grid or size does not match,
+ * or that was saved longer ago than the caller's ttl, is not used.
+ */
+#ifndef FORECAST_SNAPSHOT_H
+#define FORECAST_SNAPSHOT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "forecast_index.h"
+#include "location_key.h"
+
+namespace detail {
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t byte_order;   // SNAPSHOT_BYTE_ORDER as written
+	uint32_t version;
+	uint64_t count;        // records
+	uint64_t data_bytes;
+	double cell_degrees;   // grid the keys were made with
+	int64_t saved_at;      // unix seconds
+};
+
+struct snapshot_record {
+	uint64_t key;
+	int64_t fetched_at;    // unix seconds
+	uint64_t offset;       // into the data area
+	uint32_t points;
+	uint32_t metrics;      // the forecast's metrics besides the temperature, see metric_mask
+};
+
+static_assert(sizeof(snapshot_header) == 48, "snapshot header layout changed");
+static_assert(sizeof(snapshot_record) == 32, "snapshot record layout changed");
+
+const char SNAPSHOT_MAGIC[8] = {'F', 'C', 'S', 'T', 'S', 'N', 'A', 'P'};
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+const uint32_t SNAPSHOT_VERSION = 2;
+
+// data bytes of a record
+inline uint64_t snapshot_record_bytes(const snapshot_record &r){
+	return (uint64_t)r.points * (sizeof(int32_t) + sizeof(double) * (1 + __builtin_popcount(r.metrics)));
+}
+
+}
+
+// a forecast as written to a snapshot
+struct snapshot_entry {
+	location_key key;
+	int64_t fetched_at; // unix seconds
+	forecast_handle data;
+};
+
+class forecast_snapshot {
+	const unsigned char *base = nullptr;
+	std::size_t length = 0;
+	detail::snapshot_header header;
+	const unsigned char *records = nullptr, *points = nullptr;
+
+	forecast_snapshot() {};
+
+	detail::snapshot_record _record(std::size_t i) const {
+		detail::snapshot_record r;
+		std::memcpy(&r, records + i * sizeof(r), sizeof(r));
+		return r;
+	}
+
+	bool _validate(const location_grid &grid, int64_t now, int64_t ttl){
+		if (length < sizeof(header))
+			return false;
+		std::memcpy(&header, base, sizeof(header));
+		if (std::memcmp(header.magic, detail::SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+				header.byte_order != detail::SNAPSHOT_BYTE_ORDER ||
+				header.version != detail::SNAPSHOT_VERSION ||
+				header.cell_degrees != grid.cell_degrees() ||
+				(ttl && now - header.saved_at > ttl))
+			return false;
+		std::size_t table = sizeof(header) + header.count * sizeof(detail::snapshot_record);
+		if (header.count > length / sizeof(detail::snapshot_record) || table > length || header.data_bytes != length - table)
+			return false;
+		records = base + sizeof(header);
+		points = base + table;
+		for (std::size_t i = 0; i < header.count; i++) {
+			auto r = _record(i);
+			if (i && _record(i - 1).key >= r.key)
+				return false;
+			if ((r.metrics & ~(metric::all & ~metric::temperature)) || r.offset > header.data_bytes ||
+					detail::snapshot_record_bytes(r) > header.data_bytes - r.offset)
+				return false;
+		}
+		return true;
+	}
+
+	public:
+
+	forecast_snapshot(const forecast_snapshot &) = delete;
+	forecast_snapshot &operator=(const forecast_snapshot &) = delete;
+
+	~forecast_snapshot(){
+		if (base)
+			munmap((void *)base, length);
+	}
+
+	// Maps the snapshot at path. Returns null if it cannot be read, does not
+	// validate, was made for another grid or is more than ttl seconds old
+	// at now (0 accepts any age).
+
+	static std::shared_ptr<const forecast_snapshot> open(const std::string &path,
+			const location_grid &grid, int64_t now, int64_t ttl){
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return nullptr;
+		struct stat info;
+		std::shared_ptr<forecast_snapshot> snapshot(new forecast_snapshot());
+		if (fstat(fd, &info) == 0 && info.st_size > 0) {
+			void *mapped = mmap(nullptr, (std::size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapped != MAP_FAILED) {
+				snapshot->base = static_cast<const unsigned char *>(mapped);
+				snapshot->length = (std::size_t)info.st_size;
+			}
+		}
+		::close(fd);
+		if (!snapshot->base || !snapshot->_validate(grid, now, ttl))
+			return nullptr;
+		return snapshot;
+	}
+
+	// Writes entries to path, replacing it atomically. Throws
+	// std::runtime_error if the file cannot be written.
+
+	static void save(const std::string &path, std::vector<snapshot_entry> entries,
+			const location_grid &grid, int64_t saved_at){
+		std::sort(entries.begin(), entries.end(),
+			[](const snapshot_entry &a, const snapshot_entry &b) { return a.key < b.key; });
+		entries.erase(std::unique(entries.begin(), entries.end(),
+			[](const snapshot_entry &a, const snapshot_entry &b) { return a.key == b.key; }), entries.end());
+
+		detail::snapshot_header header = {};
+		std::memcpy(header.magic, detail::SNAPSHOT_MAGIC, sizeof(header.magic));
+		header.byte_order = detail::SNAPSHOT_BYTE_ORDER;
+		header.version = detail::SNAPSHOT_VERSION;
+		header.count = entries.size();
+		header.cell_degrees = grid.cell_degrees();
+		header.saved_at = saved_at;
+		std::vector<detail::snapshot_record> table;
+		for (auto &entry : entries) {
+			metric_mask extra = entry.data->metrics() & ~metric::temperature;
+			table.push_back({entry.key, entry.fetched_at, header.data_bytes, (uint32_t)entry.data->size(), extra});
+			header.data_bytes += detail::snapshot_record_bytes(table.back());
+		}
+
+		std::string temporary = path + ".tmp";
+		{
+			std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+			out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			out.write(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(table[0]));
+			for (auto &entry : entries) {
+				const forecast_index &index = *entry.data;
+				for (std::size_t k = 0; k < index.size(); k++) {
+					int32_t dt = index.time(k);
+					out.write(reinterpret_cast<const char *>(&dt), sizeof(dt));
+				}
+				for (metric_mask m = metric::temperature; m & metric::all; m <<= 1) {
+					auto column = index.column(m);
+					for (std::size_t k = 0; column && k < index.size(); k++) {
+						double value = (*column)[k];
+						out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+					}
+				}
+			}
+			if (!out.flush())
+				throw std::runtime_error("could not write forecast snapshot " + temporary);
+		}
+		if (std::rename(temporary.c_str(), path.c_str()) != 0)
+			throw std::runtime_error("could not replace forecast snapshot " + path);
+	}
+
+	std::size_t size() const { return header.count; }
+	int64_t saved_at() const { return header.saved_at; }
+
+	// decodes the forecast saved for key, false if there is none
+
+	bool find(location_key key, forecast_handle &data, int64_t &fetched_at) const {
+		std::size_t low = 0, high = header.count;
+		while (low < high) {
+			std::size_t mid = low + (high - low) / 2;
+			if (_record(mid).key < key)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		if (low == header.count)
+			return false;
+		auto r = _record(low);
+		if (r.key != key)
+			return false;
+		std::vector<int32_t> dt(r.points);
+		std::vector<double> values(r.points);
+		const unsigned char *column = points + r.offset;
+		std::memcpy(dt.data(), column, r.points * sizeof(int32_t));
+		for (std::size_t k = 1; k < dt.size(); k++)
+			if (dt[k - 1] >= dt[k])
+				return false;
+		column += r.points * sizeof(int32_t);
+		std::memcpy(values.data(), column, r.points * sizeof(double));
+		auto index = std::make_shared<forecast_index>(dt, values);
+		for (metric_mask m = metric::humidity; m & metric::all; m <<= 1) {
+			if (!(r.metrics & m))
+				continue;
+			column += r.points * sizeof(double);
+			std::memcpy(values.data(), column, r.points * sizeof(double));
+			index->set_metric(m, values);
+		}
+		data = std::move(index);
+		fetched_at = r.fetched_at;
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ * @file forecast_tier.h
+ *
+ * Second cache tier shared between processes. Every process keeps its own
+ * LFU_cache_client, so without a shared tier a fleet fetches the same
+ * location once per node. forecast_tier is the interface to a shared
+ * key/value store (Redis, memcached, ...); tiered_fetcher sits between a
+ * client and its upstream fetcher, answering from the tier when it can and
+ * writing every upstream fetch back to it, so one node's miss warms all the
+ * others.
+ *
+ * Values use a compact binary format (see encode_tier_value()), around a
+ * hundred bytes for a five day forecast rather than the 15KB response.
+ * memory_forecast_tier is an in-process implementation, for tests and for
+ * sharing one tier between several clients of the same process.
+ */
+#ifndef FORECAST_TIER_H
+#define FORECAST_TIER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "forecast_fetcher.h"
+#include "forecast_index.h"
+#include "location_key.h"
+
+class forecast_tier {
+
+	public:
+
+	virtual ~forecast_tier() {}
+
+	// Looks key up, returns false on a miss. Called from any thread,
+	// implementations must be thread safe.
+	virtual bool get(const std::string &key, std::string &value) = 0;
+
+	// Stores value under key for ttl_seconds (0 for no expiry). Failures
+	// are the implementation's to log, the fetch that triggered them still
+	// succeeds.
+	virtual void put(const std::string &key, const std::string &value, int64_t ttl_seconds) = 0;
+
+	// true if get() never waits on I/O, so tiered_fetcher may call it on
+	// the fetching thread rather than queue it for its own workers
+	virtual bool in_process() const { return false; }
+};
+
+const uint8_t TIER_VALUE_VERSION = 2;
+
+// A tier value: a version byte, the fetch time in unix seconds, then the
+// index as written by forecast_index::encode()
+
+inline std::string encode_tier_value(const forecast_index &index, int64_t fetched_at){
+	std::string out;
+	detail::put_field(out, TIER_VALUE_VERSION);
+	detail::put_field(out, fetched_at);
+	index.encode(out);
+	return out;
+}
+
+// parses a tier value, null if it is malformed or of another version
+inline forecast_handle decode_tier_value(const std::string &value, int64_t &fetched_at){
+	const char *p = value.data(), *end = p + value.size();
+	uint8_t version;
+	auto index = std::make_shared<forecast_index>();
+	if (!detail::get_field(p, end, version) || version != TIER_VALUE_VERSION ||
+			!detail::get_field(p, end, fetched_at) || !forecast_index::decode(p, end, *index) || p != end)
+		return nullptr;
+	return index;
+}
+
+class memory_forecast_tier : public forecast_tier {
+	typedef std::chrono::steady_clock clock;
+
+	std::mutex lock;
+	std::unordered_map<std::string, std::pair<std::string, clock::time_point>> values;
+
+	public:
+
+	bool get(const std::string &key, std::string &value) override {
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = values.find(key);
+		if (it == values.end())
+			return false;
+		if (it->second.second <= clock::now()) {
+			values.erase(it);
+			return false;
+		}
+		value = it->second.first;
+		return true;
+	}
+
+	bool in_process() const override { return true; }
+
+	void put(const std::string &key, const std::string &value, int64_t ttl_seconds) override {
+		auto expires_at = ttl_seconds ? clock::now() + std::chrono::seconds(ttl_seconds) : clock::time_point::max();
+		std::lock_guard<std::mutex> guard(lock);
+		values[key] = std::make_pair(value, expires_at);
+	}
+
+	std::size_t size(){
+		std::lock_guard<std::mutex> guard(lock);
+		return values.size();
+	}
+};
+
+struct tier_options {
+	std::string prefix = "forecast"; // namespaces the keys in a store shared with other data
+	int64_t ttl_seconds = 3 * 60 * 60; // lifetime in the tier, also the oldest value served from it
+	int64_t client_max_age_seconds = 0; // expiry_policy::max_age of the clients served, see below
+	unsigned int lookup_threads = 4; // workers for lookups in a tier that is not in_process()
+};
+
+// Forecast fetcher that checks the shared tier before its upstream fetcher
+// and stores what upstream returns. Lookups in a remote tier run on the
+// fetcher's own workers, so fetch_async() never waits on the store (clients
+// call it holding a shard lock); only an in_process() tier is read on the
+// calling thread. Upstream requests complete on upstream's threads as before.
+//
+// A client caches what it is given as if it had just been fetched, so a
+// value taken from the tier is served for its age there plus the client's
+// max_age. Values are only served while they are at most ttl_seconds minus
+// client_max_age_seconds old, which keeps what clients serve within
+// ttl_seconds of the upstream fetch.
+
+class tiered_fetcher : public forecast_fetcher {
+
+	struct job {
+		double lat, lon;
+		callback done;
+	};
+
+	std::shared_ptr<forecast_tier> tier;
+	std::shared_ptr<forecast_fetcher> upstream;
+	location_grid grid;
+	tier_options options;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<job> queue;
+	bool stopping = false;
+	std::vector<std::thread> workers;
+
+	static int64_t _now(){
+		return std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	void _work(){
+		for (;;) {
+			job next;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [&]() { return stopping || !queue.empty(); });
+				if (queue.empty())
+					return;
+				next = std::move(queue.front());
+				queue.pop_front();
+			}
+			_fetch(next.lat, next.lon, std::move(next.done));
+		}
+	}
+
+	// answers from the tier if it holds a value young enough, otherwise
+	// passes the request on to upstream
+	void _fetch(double lat, double lon, callback done){
+		std::string key = tier_key(lat, lon), value;
+		try {
+			if (tier->get(key, value)) {
+				int64_t fetched_at;
+				if (auto data = decode_tier_value(value, fetched_at)) {
+					if (!options.ttl_seconds || _now() - fetched_at <= options.ttl_seconds - options.client_max_age_seconds) {
+						done(std::move(data), nullptr);
+						return;
+					}
+				}
+			}
+		} catch (const std::exception &) {
+			// an unreachable tier only costs the upstream fetch
+		}
+		auto shared_tier = tier;
+		int64_t ttl = options.ttl_seconds;
+		upstream->fetch_async(lat, lon, [shared_tier, key, ttl, done](forecast_handle data, std::exception_ptr error) {
+			if (!error) {
+				try {
+					shared_tier->put(key, encode_tier_value(*data, _now()), ttl);
+				} catch (const std::exception &) {
+				}
+			}
+			done(std::move(data), error);
+		});
+	}
+
+	public:
+
+	tiered_fetcher(std::shared_ptr<forecast_tier> tier,
+			std::shared_ptr<forecast_fetcher> upstream = forecast_fetcher::shared(),
+			location_grid grid = location_grid(), tier_options options = tier_options())
+		: tier(std::move(tier)), upstream(std::move(upstream)), grid(grid), options(std::move(options)) {
+		if (this->tier->in_process())
+			return;
+		unsigned int count = this->options.lookup_threads ? this->options.lookup_threads : 1;
+		for (unsigned int i = 0; i < count; i++)
+			workers.emplace_back(&tiered_fetcher::_work, this);
+	}
+
+	// finishes the queued lookups before returning
+	~tiered_fetcher(){
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+	}
+
+	// store key for lat/lon, the cell and its size so clients with different
+	// grids do not share values
+	std::string tier_key(double lat, double lon) const {
+		std::ostringstream oss;
+		oss << options.prefix << ':' << grid.cell_degrees() << ':' << grid.key(lat, lon);
+		return oss.str();
+	}
+
+	void fetch_async(double lat, double lon, callback done) override {
+		if (workers.empty()) {
+			_fetch(lat, lon, std::move(done));
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			queue.push_back({lat, lon, std::move(done)});
+		}
+		wake.notify_one();
+	}
+};
+
+#endif
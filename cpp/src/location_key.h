@@ -0,0 +1,73 @@
+/*
+ * @file location_key.h
+ *
+ * Cache keys for locations. Coordinates are snapped to a grid of cells
+ * (0.01 degrees, roughly a kilometre, by default) and the two signed cell
+ * indices are packed into one 64-bit integer, so requests a hair apart share
+ * an entry and keys are cheap to compare and hash. The forecast for a key is
+ * fetched for its cell's center, which keeps the cached data independent of
+ * which nearby request happened to miss first.
+ */
+#ifndef LOCATION_KEY_H
+#define LOCATION_KEY_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+typedef uint64_t location_key;
+
+class location_grid {
+	double cells_per_degree;
+
+	public:
+
+	location_grid(double cell_degrees = 0.01) : cells_per_degree(1.0 / cell_degrees) {};
+
+	location_key key(double lat, double lon) const {
+		int32_t lat_cell = (int32_t)std::llround(lat * cells_per_degree);
+		int32_t lon_cell = (int32_t)std::llround(lon * cells_per_degree);
+		return ((location_key)(uint32_t)lat_cell << 32) | (uint32_t)lon_cell;
+	}
+
+	// lat/lon of the center of key's cell
+	std::pair<double, double> center(location_key key) const {
+		int32_t lat_cell = (int32_t)(uint32_t)(key >> 32);
+		int32_t lon_cell = (int32_t)(uint32_t)key;
+		return std::make_pair(lat_cell / cells_per_degree, lon_cell / cells_per_degree);
+	}
+
+	double cell_degrees() const { return 1.0 / cells_per_degree; }
+};
+
+const double EARTH_RADIUS_KM = 6371.0;
+const double KM_PER_DEGREE = EARTH_RADIUS_KM * 3.14159265358979323846 / 180.0; // along a meridian
+
+// great circle distance between two lat/lon pairs
+
+inline double haversine_km(std::pair<double, double> a, std::pair<double, double> b){
+	const double radians = 3.14159265358979323846 / 180.0;
+	double dlat = (b.first - a.first) * radians, dlon = (b.second - a.second) * radians;
+	double h = std::sin(dlat / 2) * std::sin(dlat / 2) +
+		std::cos(a.first * radians) * std::cos(b.first * radians) * std::sin(dlon / 2) * std::sin(dlon / 2);
+	return 2 * EARTH_RADIUS_KM * std::asin(std::min(1.0, std::sqrt(h)));
+}
+
+// std::hash of an integer is the identity on common standard libraries,
+// which maps neighbouring cells to neighbouring buckets and shards. This is
+// the splitmix64 finalizer instead.
+
+struct location_key_hash {
+	std::size_t operator()(location_key key) const {
+		key ^= key >> 30;
+		key *= 0xbf58476d1ce4e5b9ULL;
+		key ^= key >> 27;
+		key *= 0x94d049bb133111ebULL;
+		key ^= key >> 31;
+		return (std::size_t)key;
+	}
+};
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * @file node_routing.h
+ *
+ * Partitioning locations across cache nodes. hash_ring assigns every
+ * location key to one node by consistent hashing: each node is placed on a
+ * 64-bit ring at a number of pseudo-random points (virtual nodes) and a key
+ * belongs to the first node point at or after its own hash. Adding or
+ * removing a node only moves the keys of the ring arcs it gains or loses,
+ * and more virtual nodes even out the share each node gets.
+ *
+ * node_transport is how a node forwards a request for a key it does not
+ * own; the owner answers with a tier value (see forecast_tier.h).
+ * in_process_transport connects nodes living in one process, for tests and
+ * for single host setups.
+ */
+#ifndef NODE_ROUTING_H
+#define NODE_ROUTING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "location_key.h"
+
+class hash_ring {
+	std::vector<std::pair<uint64_t, std::string>> points; // sorted by position
+
+	static uint64_t _position(const std::string &node, unsigned int replica){
+		uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a over name and replica
+		for (unsigned char c : node)
+			h = (h ^ c) * 0x100000001b3ULL;
+		for (int i = 0; i < 4; i++)
+			h = (h ^ ((replica >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+		return location_key_hash()(h);
+	}
+
+	public:
+
+	// places node on the ring at virtual_nodes points; adding a node that is
+	// already there replaces its points
+
+	void add_node(const std::string &node, unsigned int virtual_nodes = 64){
+		remove_node(node);
+		for (unsigned int i = 0; i < virtual_nodes; i++)
+			points.emplace_back(_position(node, i), node);
+		std::sort(points.begin(), points.end());
+	}
+
+	void remove_node(const std::string &node){
+		points.erase(std::remove_if(points.begin(), points.end(),
+			[&](const std::pair<uint64_t, std::string> &p) { return p.second == node; }), points.end());
+	}
+
+	// node owning key, throws std::logic_error if the ring is empty
+
+	const std::string &owner(location_key key) const {
+		if (points.empty())
+			throw std::logic_error("hash ring has no nodes");
+		uint64_t position = location_key_hash()(key);
+		auto it = std::lower_bound(points.begin(), points.end(), position,
+			[](const std::pair<uint64_t, std::string> &p, uint64_t x) { return p.first < x; });
+		return (it == points.end() ? points.front() : *it).second;
+	}
+
+	bool empty() const { return points.empty(); }
+	std::size_t virtual_nodes() const { return points.size(); }
+};
+
+class node_transport {
+
+	public:
+
+	virtual ~node_transport() {}
+
+	// asks node for the forecast of lat/lon, returns its tier value; throws
+	// if node cannot be reached or fails the request
+	virtual std::string forward(const std::string &node, double lat, double lon) = 0;
+};
+
+class in_process_transport : public node_transport {
+	typedef std::function<std::string(double, double)> handler;
+
+	std::mutex lock;
+	std::unordered_map<std::string, handler> nodes;
+
+	public:
+
+	// routes requests for node to serve, which runs on the forwarding thread
+	void attach(const std::string &node, handler serve){
+		std::lock_guard<std::mutex> guard(lock);
+		nodes[node] = std::move(serve);
+	}
+
+	void detach(const std::string &node){
+		std::lock_guard<std::mutex> guard(lock);
+		nodes.erase(node);
+	}
+
+	std::string forward(const std::string &node, double lat, double lon) override {
+		handler serve;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			auto it = nodes.find(node);
+			if (it == nodes.end())
+				throw std::runtime_error("no route to cache node " + node);
+			serve = it->second;
+		}
+		return serve(lat, lon);
+	}
+};
+
+#endif
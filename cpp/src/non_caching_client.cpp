@@ -15,13 +15,30 @@
 #include <string>
 #include <iostream>
 #include <sstream>
+#include <fstream>
 #include "nlohmann/json.hpp"
 #include "bandit/bandit.h"
-#include "btree/map.h"
 #include <vector>
 #include <map>
 #include <algorithm>
 #include <chrono>
+#include <memory>
+#include <functional>
+#include <list>
+#include <queue>
+#include <future>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <tuple>
+#include <shared_mutex>
+#include <thread>
+#include <atomic>
+#include <random>
+#include "cache_clients.h"
+#include "forecast_parser.h"
+#include "synthetic.h"
+#include "trace_replay.h"
 
 
 
@@ -34,251 +51,105 @@ using namespace std::chrono;
 
 
 
-const int TWO_HOURS = 2 * 60 * 60;
-const int ONE_DAY = 24 * 60 * 60;
-const int MINUTE = 60;
-const int FIVE_MINUTES = 5 * 60;
-const int ONE_HOUR = 60 * 60;
-
-typedef std::pair<double, double> key_pair;
-
-
-
-class NonCachingClient {
-	double lat, lon;
-
-	vector<tuple<int, double>> get_remote_data_five_day_forecast()
-	{
-	    ostringstream oss;
-	    oss << "http://REDACTED"
-		<< lat
-		<< "&lon="
-		<< lon;
-	    const string url = oss.str();
-	    RestClient::Response r = RestClient::get(url);
-	    auto parsed = json::parse(r.body);
-
-	    unsigned response_count = parsed["cnt"]; // number of responses
-	    vector<tuple<int, double>> data(response_count);
-	    for (auto &element : parsed["list"])
-	    {
-		data.push_back({element["dt"], element["main"]["temp"]});
-	    }
-	    return data;
+// fetcher for tests that must not touch the network, every request fails
+class failing_fetcher : public forecast_fetcher {
+	public:
+	void fetch_async(double, double, callback done) override {
+		done(nullptr, std::make_exception_ptr(std::runtime_error("offline")));
 	}
+};
 
-	public:
+// holds every request until release(), which completes them with synthetic forecasts
+class deferred_fetcher : public forecast_fetcher {
+	std::mutex lock;
+	vector<std::tuple<double, double, callback>> held;
 
-	NonCachingClient(double lat, double lon) : lat(lat), lon(lon) {};
+	public:
+	void fetch_async(double lat, double lon, callback done) override {
+		std::lock_guard<std::mutex> guard(lock);
+		held.emplace_back(lat, lon, std::move(done));
+	}
 
-	vector<double> query(int start, int end) {
-		auto data = get_remote_data_five_day_forecast();
-		btree::map<int, double> data_map;
-		for (auto &tup : data) {
-			data_map.insert(tup);
+	size_t release(bool fail = false){
+		vector<std::tuple<double, double, callback>> ready;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			ready.swap(held);
 		}
-		auto granularity = ONE_HOUR;
-		auto requested_range = end - start;
-		if (requested_range < TWO_HOURS) {
-		    granularity = MINUTE;
-		} else if (requested_range < ONE_DAY) {
-		    granularity = FIVE_MINUTES;
-		};
-		vector<double> ret;
-		for (int i = start; i < end; i += granularity) {
-			auto low = data_map.lower_bound(i);
-			if (low == data_map.end()) {
-			} else if (low == data_map.begin()) {
-				ret.push_back(low->second);
-			} else {
-				auto prev = std::prev(low);
-				if ((i - prev->first) < (low->first - i))
-					ret.push_back(prev->second);
-				else
-					ret.push_back(low->second);
-			}
+		for (auto &request : ready) {
+			if (fail)
+				std::get<2>(request)(nullptr, std::make_exception_ptr(std::runtime_error("offline")));
+			else
+				std::get<2>(request)(std::make_shared<const forecast_index>(synthetic_fetcher::forecast_for(
+					std::get<0>(request), std::get<1>(request), 1659722400)), nullptr);
 		}
-		return ret;
+		return ready.size();
 	}
 };
 
-
-/*   Client built with caches
- *
- *   In-memory design was used to build this caching system. The caching design implemented
- *   is a Least Frequently used caching system, which removes the least frequently used 
- *   query when the size of the cache has exceeded. This implementation made use of
- *   three different hash maps, two of which used lan/lon as keys to determine
- *   corresponding data, and frequency. Cache_frequency keeps track of each pair
- *   and how many times its been called. cache_data keeps track of the data corresponding
- *   to the given pair. freq_map holds frequencies as keys and a vector of pairs.
- *   This map is used when removing from the cache. It will pick the LFU which in this case
- *   will always be the first element in the map(given the map is ordered) and find the value
- *   (pair) to be removed from all maps. In event of a tie(multiple pairs in one frequency)
- *   the first element in the vector will be the one removed from the cache as it will be 
- *   the oldest element.Below this map is visualized(as best as possible)
- *
- *			       Oldest pair, and lowest frequency(frequency = 1)
- *						     |
- *						     V
- *		freq_map[frequency = 1] -> <(lat_key1, lon_key1), (lat_key2, lon_key2)>
- *		freq_map[frequency = 2] -> <(lat_key3, lon_key3)
- *				.
- *				.
- *				.
- *		freq_map[frequency = n] -> <(lat_keyK, long_keyK).....>		
- */
-
-
-class LFU_cache_client {
-
-	unsigned int cache_size;  // cache size == len(hash map)
-	double client_lat, client_lon;
-	std::map<key_pair, unsigned int> cache_frequency; // map for frequency
-	std::map<key_pair, std::vector<tuple<int, double>>> cache_data; // map for data
-	std::map<unsigned int, vector<key_pair>> freq_map;	// map containing frequencies and vector of keys for that frequency
-
-        std::vector<tuple<int, double>> get_remote_data_five_day_forecast(){
-            ostringstream oss; 
-            oss << "http://REDACTED"
-                << client_lat
-                << "&lon="
-                << client_lon;
-            const string url = oss.str();
-            RestClient::Response r = RestClient::get(url);
-            auto parsed = json::parse(r.body);
-
-            unsigned response_count = parsed["cnt"]; // number of responses
-            vector<tuple<int, double>> data(response_count);
-            for (auto &element : parsed["list"])
-            {
-                data.push_back({element["dt"], element["main"]["temp"]});
-            }
-            return data;
-        }
-
-	// Deletes a specific key from vector within freq_map
-	// done when frequency changes for specific key
-        
-        void _erase(unsigned int count, key_pair map_key_pair){
-                freq_map[count].erase(std::remove(freq_map[count].begin(),
-                freq_map[count].end(), map_key_pair), freq_map[count].end());
-        }
-	
-	// Adds a key pair to vector corresponding to its given frequency
-	// if frequency doesn't exist, add frequency to map
-
-        void _add(unsigned int count, key_pair map_key_pair){
-                if(freq_map.find(count)!=freq_map.end()){
-                        freq_map[count].push_back(map_key_pair);
-                        return;
-                }
-                vector<key_pair> temp;
-                temp.push_back(map_key_pair);
-                freq_map.insert({count, temp});
-        }
-
-	// deletes smallest and oldest(if tie) element from all maps
-	// if size of map becomes greater than the size it 
-	// was init as.
-
-        void _delete(){
-                if(freq_map.empty()){
-                        return;
-                }
-                key_pair temp_key = freq_map.begin()->second.front();
-                _erase(freq_map.begin()->first, temp_key);
-                if(freq_map.begin()->second.empty()){
-                        freq_map.erase(freq_map.begin()->first);
-                }
-                cache_frequency.erase(temp_key);
-                cache_data.erase(temp_key);
-        }
-
-        // pulls data, checks to see if map is full. If it is,
-        // call _delete to remove LFU, if not simply insert into maps(cache)
-
-        vector<tuple<int, double>> _put(){
-                key_pair map_key_pair = std::make_pair(client_lat, client_lon);
-                auto result = get_remote_data_five_day_forecast();
-                if(cache_data.size() >= cache_size){
-                        _delete();
-                }
-                cache_data.insert({map_key_pair, result});
-                cache_frequency.insert({map_key_pair, 1});
-                _add(cache_frequency[map_key_pair], map_key_pair);
-                return result;
-        }
+// a tier whose lookups wait while it is closed, standing in for a slow store
+class slow_forecast_tier : public forecast_tier {
+	memory_forecast_tier values;
+	std::mutex lock;
+	std::condition_variable opened;
+	bool closed = false;
+	size_t waiting = 0;
 
 	public:
+	bool get(const std::string &key, std::string &value) override {
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			waiting++;
+			opened.wait(guard, [&]() { return !closed; });
+			waiting--;
+		}
+		return values.get(key, value);
+	}
 
-	// Set cache size
-	LFU_cache_client(unsigned int cache_size) : cache_size(cache_size) {};
-	
-	// define lat/lon
-	void set_pair(double lat, double lon){
-		client_lat = lat; 
-		client_lon = lon;
-	} 
-	
-	// looks for pair(lat/lon) in map, if found(hit)
-	// add corresponding frequencies to map and return results
-	// if not found(cache miss) call _put()
+	void put(const std::string &key, const std::string &value, int64_t ttl_seconds) override {
+		values.put(key, value, ttl_seconds);
+	}
 
-	vector<tuple<int, double>> _get(){
-		auto map_key_pair = std::make_pair(client_lat,client_lon);
-		if(cache_data.find(map_key_pair)!=cache_data.end()){
-			auto result = cache_data[map_key_pair];
-			_erase(cache_frequency[map_key_pair], map_key_pair);
-			cache_frequency[map_key_pair]++;
-			_add(cache_frequency[map_key_pair], map_key_pair);
-			return result;
-		}
-		return _put();
+	void close(){
+		std::lock_guard<std::mutex> guard(lock);
+		closed = true;
 	}
-	void _clear(){
-		cache_frequency.clear();
-		cache_data.clear();
-		freq_map.clear();
+
+	void open(){
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			closed = false;
+		}
+		opened.notify_all();
 	}
 
-        vector<double> query(int start, int end) {
-                auto data = _get(); // calls _get() instead of restapi method, this allows to check if data is in cache.
-                btree::map<int, double> data_map;
-                for (auto &tup : data) {
-                        data_map.insert(tup);
-                }
-                auto granularity = ONE_HOUR;
-                auto requested_range = end - start;
-                if (requested_range < TWO_HOURS) {
-                    granularity = MINUTE;
-                } else if (requested_range < ONE_DAY) {
-                    granularity = FIVE_MINUTES;
-                };
-                vector<double> ret;
-                for (int i = start; i < end; i += granularity) {
-                        auto low = data_map.lower_bound(i);
-                        if (low == data_map.end()) {
-                        } else if (low == data_map.begin()) {
-                                ret.push_back(low->second);
-                        } else {
-                                auto prev = std::prev(low);
-                                if ((i - prev->first) < (low->first - i))
-                                        ret.push_back(prev->second);
-                                else
-                                        ret.push_back(low->second);
-                        }
-                }
-                return ret;
-        }
-	
+	size_t lookups_waiting(){
+		std::lock_guard<std::mutex> guard(lock);
+		return waiting;
+	}
 };
 
+// Hit rate of a policy_cache of capacity over a trace of keys, the value
+// cached for k is always k * 10 so lost or mixed up entries fail the check
 
-
+template <template <typename, typename> class Policy>
+double replay_hit_rate(const vector<int> &trace, size_t capacity){
+	policy_cache<int, int, Policy> cache(capacity);
+	size_t hits = 0;
+	for (int key : trace) {
+		if (int *value = cache.find(key)) {
+			AssertThat(*value, Equals(key * 10));
+			hits++;
+		} else {
+			cache.insert(key, key * 10);
+		}
+		AssertThat(cache.size(), IsLessThanOrEqualTo(capacity));
+	}
+	return (double)hits / trace.size();
+}
 
 go_bandit([]() {
-	const int SAMPLE_DATA_START = 1659722400;
+	static const int SAMPLE_DATA_START = 1659722400;
 	describe("remote_data", []() {
 		it("demonstrates interpolation", [&]() {
 			auto start = SAMPLE_DATA_START;
@@ -302,54 +173,1043 @@ go_bandit([]() {
                         AssertThat(data_cache[0], Equals(290.18));
                         AssertThat(data_cache[1], Equals(290.18));
                 });
+		it("reuses the cached index on a hit", [&]() {
+			auto cache = LFU_cache_client(10);
+			cache.set_pair(47.36, -122.19);
+			const forecast_index *first = cache._get().get();
+			AssertThat(cache._get().get() == first, Equals(true));
+		});
+		it("refetches an expired entry", [&]() {
+			auto now = forecast_clock::from_time_t(SAMPLE_DATA_START);
+			expiry_policy expiry;
+			expiry.max_age = std::chrono::hours(3);
+			auto cache = LFU_cache_client(10, expiry);
+			cache.set_clock([&]() { return now; });
+			cache.set_pair(47.36, -122.19);
+			auto first = cache._get();
+			now += std::chrono::hours(2);
+			AssertThat(cache._get() == first, Equals(true));
+			now += std::chrono::hours(2);
+			AssertThat(cache._get() == first, Equals(false));
+		});
+		it("sweeps expired entries", [&]() {
+			auto now = forecast_clock::from_time_t(SAMPLE_DATA_START);
+			expiry_policy expiry;
+			expiry.max_age = std::chrono::hours(1);
+			auto cache = LFU_cache_client(10, expiry);
+			cache.set_clock([&]() { return now; });
+			cache.set_pair(47.36, -122.19);
+			cache._get();
+			cache.set_pair(45.62, -122.67);
+			cache._get();
+			AssertThat(cache._sweep(), Equals(0u));
+			now += std::chrono::hours(2);
+			AssertThat(cache._sweep(), Equals(2u));
+			AssertThat(cache.size(), Equals(0u));
+		});
+		it("caches exactly the points in the payload", [&]() {
+			auto cache = LFU_cache_client(10);
+			cache.set_pair(47.36, -122.19);
+			auto &data = *cache._get();
+			AssertThat(data.size(), Equals(40u));
+			AssertThat(data.first_time(), Equals(SAMPLE_DATA_START));
+			AssertThat(data.temperature(0), Equals(290.18));
+			AssertThat(data.compact(), Equals(true));
+		});
+		it("queries several metrics from the one fetch", [&]() {
+			auto start = SAMPLE_DATA_START;
+			auto end = start + 25 * ONE_HOUR;
+			auto cache = LFU_cache_client(10);
+			cache.set_pair(47.36, -122.19);
+			auto &data = *cache._get();
+			AssertThat(data.metrics(), Equals(metric::all));
+			AssertThat(data.column(metric::humidity)->packed(), Equals(true));
+			auto series = cache.query_metrics(metric::temperature | metric::humidity | metric::wind_speed, start, end);
+			AssertThat(series.metrics, Equals(metric::temperature | metric::humidity | metric::wind_speed));
+			AssertThat(series.length, Equals(25u));
+			AssertThat(series.series(metric::precipitation) == nullptr, Equals(true));
+			auto temperature = cache.query(start, end);
+			for (size_t k = 0; k < series.length; k++)
+				AssertThat(series.series(metric::temperature)[k], Equals(temperature[k]));
+			AssertThat(series.series(metric::humidity)[0], Equals(66.0));
+			AssertThat(series.series(metric::humidity)[2], Equals(48.0)); // 02:00 is nearer the 03:00 point
+			AssertThat(series.series(metric::wind_speed)[0], Equals(3.25));
+			sharded_LFU_cache_client<> sharded(10, 2);
+			auto pop = sharded.query_metrics(47.36, -122.19, metric::precipitation, start, end);
+			AssertThat(pop.metrics, Equals(metric::precipitation));
+			AssertThat(pop.series(metric::precipitation)[0], Equals(0.0));
+		});
+		it("expires once the first point falls behind", [&]() {
+			auto now = forecast_clock::from_time_t(SAMPLE_DATA_START);
+			expiry_policy expiry;
+			expiry.first_point_lag = std::chrono::hours(1);
+			auto cache = LFU_cache_client(10, expiry);
+			cache.set_clock([&]() { return now; });
+			cache.set_pair(47.36, -122.19);
+			auto first = cache._get();
+			now += std::chrono::minutes(59);
+			AssertThat(cache._get() == first, Equals(true));
+			now += std::chrono::minutes(2);
+			AssertThat(cache._sweep(), Equals(1u));
+		});
+		it("serves a forecast that arrives already expired", [&]() {
+			auto now = forecast_clock::from_time_t(SAMPLE_DATA_START + 5 * ONE_HOUR);
+			expiry_policy expiry;
+			expiry.first_point_lag = std::chrono::hours(1);
+			auto cache = LFU_cache_client(10, expiry);
+			cache.set_clock([&]() { return now; });
+			cache.set_pair(47.36, -122.19);
+			AssertThat(cache._get()->temperature(0), Equals(290.18));
+			AssertThat(cache.size(), Equals(1u));
+			auto data = cache.query(SAMPLE_DATA_START, SAMPLE_DATA_START + 25 * ONE_HOUR);
+			AssertThat(data.size(), Equals(25u));
+			AssertThat(data[0], Equals(290.18));
+			AssertThat(cache._sweep(), Equals(1u));
+		});
+		it("shares an entry between nearby coordinates", [&]() {
+			auto cache = LFU_cache_client(10);
+			cache.set_pair(47.36, -122.19);
+			auto first = cache._get();
+			cache.set_pair(47.3600000001, -122.1899999);
+			AssertThat(cache._get() == first, Equals(true));
+			AssertThat(cache.size(), Equals(1u));
+		});
+		it("answers a batch of locations in one buffer", [&]() {
+			auto start = SAMPLE_DATA_START;
+			auto end = start + 25 * ONE_HOUR;
+			auto cache = LFU_cache_client(10);
+			cache.set_pair(47.36, -122.19);
+			auto seattle = cache.query(start, end);
+			auto batch = cache.query_batch({{45.62, -122.67}, {47.36, -122.19}, {45.62, -122.67}}, start, end);
+			AssertThat(batch.size(), Equals(3u));
+			AssertThat(batch.values.size(), Equals(75u));
+			AssertThat(batch.length(1), Equals(25u));
+			AssertThat(std::equal(seattle.begin(), seattle.end(), batch.series(1)), Equals(true));
+			AssertThat(std::equal(batch.series(0), batch.series(0) + 25, batch.series(2)), Equals(true));
+			AssertThat(cache.size(), Equals(2u));
+		});
+		it("writes into a caller buffer", [&]() {
+			auto start = SAMPLE_DATA_START;
+			auto end = start + 25 * ONE_HOUR;
+			auto cache = LFU_cache_client(10);
+			cache.set_pair(47.36, -122.19);
+			auto expected = cache.query(start, end);
+			double out[30];
+			AssertThat(cache.query(start, end, out, 30), Equals(25u));
+			AssertThat(std::equal(expected.begin(), expected.end(), out), Equals(true));
+			out[10] = -1;
+			AssertThat(cache.query(start, end, out, 10), Equals(25u));
+			AssertThat(out[10], Equals(-1.0));
+		});
+		it("keeps views valid after eviction", [&]() {
+			auto cache = LFU_cache_client(1);
+			cache.set_pair(47.36, -122.19);
+			auto seattle = cache.view();
+			cache.set_pair(45.62, -122.67);
+			cache.view();
+			AssertThat(seattle.use_count(), Equals(1));
+			AssertThat(seattle->temperature(0), Equals(290.18));
+		});
+		it("reuses resampled windows until the forecast changes", [&]() {
+			auto now = forecast_clock::from_time_t(SAMPLE_DATA_START);
+			expiry_policy expiry;
+			expiry.max_age = std::chrono::hours(1);
+			auto cache = LFU_cache_client(10, expiry);
+			cache.set_clock([&]() { return now; });
+			cache.set_pair(47.36, -122.19);
+			auto start = SAMPLE_DATA_START;
+			auto first = cache.query_window(start, start + 25 * ONE_HOUR);
+			AssertThat(first->size(), Equals(25u));
+			AssertThat(cache.query_window(start, start + 25 * ONE_HOUR - 1) == first, Equals(true));
+			AssertThat(cache.query_window(start, start + 25 * ONE_HOUR, resample_mode::linear) == first, Equals(false));
+			now += std::chrono::hours(2);
+			AssertThat(cache.query_window(start, start + 25 * ONE_HOUR) == first, Equals(false));
+		});
+		it("takes the eviction policy as a parameter", [&]() {
+			auto cache = LFU_cache_client<lru_policy>(1);
+			cache.set_pair(47.36, -122.19);
+			cache._get();
+			cache._get();
+			cache.set_pair(45.62, -122.67);
+			cache._get();
+			AssertThat(cache.size(), Equals(1u));
+			AssertThat(cache._get()->temperature(0), IsGreaterThan(0.0));
+		});
+		it("evicts by memory with a byte budget", [&]() {
+			auto probe = LFU_cache_client(10);
+			probe.set_pair(47.36, -122.19);
+			probe._get();
+			size_t one = probe.bytes_used();
+			AssertThat(one, IsGreaterThan(sizeof(forecast_index)));
+			auto cache = LFU_cache_client(byte_budget{one + one / 2});
+			cache.set_pair(47.36, -122.19);
+			cache._get();
+			AssertThat(cache.bytes_used(), Equals(one));
+			cache.query(SAMPLE_DATA_START, SAMPLE_DATA_START + 5 * ONE_DAY);
+			AssertThat(cache.bytes_used(), IsGreaterThan(one));
+			cache.set_pair(45.62, -122.67);
+			cache._get();
+			AssertThat(cache.size(), Equals(1u));
+			AssertThat(cache.bytes_used(), IsLessThanOrEqualTo(one + one / 2));
+			cache._clear();
+			AssertThat(cache.bytes_used(), Equals(0u));
+		});
+		it("warm starts from a snapshot", [&]() {
+			auto now = forecast_clock::from_time_t(SAMPLE_DATA_START);
+			expiry_policy expiry;
+			expiry.max_age = std::chrono::hours(3);
+			std::string path = "/tmp/forecast_snapshot_test.bin";
+			{
+				auto cache = LFU_cache_client(10, expiry);
+				cache.set_clock([&]() { return now; });
+				cache.set_pair(47.36, -122.19);
+				cache._get();
+				cache.set_pair(45.62, -122.67);
+				cache._get();
+				cache.save_snapshot(path);
+			}
+			now += std::chrono::hours(1);
+			auto offline = LFU_cache_client(10, expiry, location_grid(), std::make_shared<failing_fetcher>());
+			offline.set_clock([&]() { return now; });
+			AssertThat(offline.load_snapshot(path, std::chrono::minutes(30)), Equals(false));
+			AssertThat(offline.load_snapshot(path, std::chrono::hours(2)), Equals(true));
+			AssertThat(offline.size(), Equals(0u));
+			offline.set_pair(47.36, -122.19);
+			AssertThat(offline._get()->temperature(0), Equals(290.18));
+			AssertThat(offline._get()->metrics(), Equals(metric::all));
+			AssertThat((*offline._get()->column(metric::wind_speed))[0], Equals(3.25));
+			AssertThat(offline.size(), Equals(1u));
+			now += std::chrono::hours(2); // three hours after the fetch, expired
+			offline._clear();
+			AssertThrows(std::runtime_error, offline._get());
+			std::remove(path.c_str());
+		});
+		it("rejects truncated and corrupted snapshots", [&]() {
+			std::string path = "/tmp/forecast_snapshot_corrupt_test.bin";
+			{
+				auto cache = LFU_cache_client(10);
+				cache.set_pair(47.36, -122.19);
+				cache._get();
+				cache.save_snapshot(path);
+			}
+			std::string bytes;
+			{
+				std::ifstream in(path, std::ios::binary);
+				bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+			}
+			auto write = [&](const std::string &contents) {
+				std::ofstream(path, std::ios::binary | std::ios::trunc) << contents;
+			};
+			auto offline = LFU_cache_client(10, expiry_policy(), location_grid(), std::make_shared<failing_fetcher>());
+			AssertThat(offline.load_snapshot(path), Equals(true));
+			write(bytes.substr(0, bytes.size() - 1));
+			AssertThat(offline.load_snapshot(path), Equals(false));
+			write(bytes.substr(0, sizeof(detail::snapshot_header) - 1));
+			AssertThat(offline.load_snapshot(path), Equals(false));
+			// an empty snapshot claiming a record past its end, data_bytes wrapping the sum back to the length
+			LFU_cache_client(10).save_snapshot(path);
+			std::string empty;
+			{
+				std::ifstream in(path, std::ios::binary);
+				empty.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+			}
+			AssertThat(empty.size(), Equals(sizeof(detail::snapshot_header)));
+			detail::snapshot_header header;
+			std::memcpy(&header, empty.data(), sizeof(header));
+			header.count = 1;
+			header.data_bytes = (uint64_t)0 - sizeof(detail::snapshot_record);
+			std::memcpy(&empty[0], &header, sizeof(header));
+			write(empty);
+			AssertThat(offline.load_snapshot(path), Equals(false));
+			std::remove(path.c_str());
+		});
+		it("falls back to a cached neighbour within the radius", [&]() {
+			auto cache = LFU_cache_client(10);
+			cache.set_pair(47.36, -122.19);
+			auto seattle = cache._get();
+			cache.set_neighbour_fallback({5.0, true});
+			cache.set_pair(47.38, -122.21); // about 2.7km away, not served by the API
+			AssertThat(cache._get() == seattle, Equals(true));
+			AssertThat(cache.size(), Equals(1u));
+			cache._wait_refreshes(); // the exact refresh fails, the neighbour stays in use
+			AssertThat(cache._get() == seattle, Equals(true));
+			cache.set_pair(45.62, -122.67); // far outside the radius
+			AssertThat(cache._get() == seattle, Equals(false));
+			AssertThat(cache.size(), Equals(2u));
+			cache.set_neighbour_fallback({});
+			cache.set_pair(47.38, -122.21);
+			AssertThrows(std::runtime_error, cache._get());
+		});
+		it("serves stale data while refreshing", [&]() {
+			auto now = forecast_clock::from_time_t(SAMPLE_DATA_START);
+			expiry_policy expiry;
+			expiry.max_age = std::chrono::hours(1);
+			expiry.stale_while_revalidate = true;
+			auto cache = LFU_cache_client(10, expiry);
+			cache.set_clock([&]() { return now; });
+			cache.set_pair(47.36, -122.19);
+			auto first = cache._get();
+			now += std::chrono::hours(2);
+			AssertThat(cache._get() == first, Equals(true));
+			cache._wait_refreshes();
+			AssertThat(cache._get() == first, Equals(false));
+		});
+		it("keeps a stale entry through other misses while it refreshes", [&]() {
+			auto now = forecast_clock::from_time_t(SAMPLE_DATA_START);
+			expiry_policy expiry;
+			expiry.max_age = std::chrono::hours(1);
+			expiry.stale_while_revalidate = true;
+			expiry.max_stale = std::chrono::hours(1);
+			auto fetcher = std::make_shared<deferred_fetcher>();
+			auto cache = LFU_cache_client(10, expiry, location_grid(), fetcher);
+			cache.set_clock([&]() { return now; });
+			auto hot = cache.get_grid().key(47.36, -122.19), other = cache.get_grid().key(45.62, -122.67);
+			auto first = cache._store(hot, std::make_shared<const forecast_index>(
+				synthetic_fetcher::forecast_for(47.36, -122.19, SAMPLE_DATA_START)));
+			now += std::chrono::minutes(90);
+			AssertThat(*cache._lookup(hot) == first, Equals(true)); // stale, the refresh is held
+			cache._store(other, first); // another miss completes, sweeping
+			AssertThat(cache.size(), Equals(2u));
+			AssertThat(fetcher->release(), Equals(1u));
+			AssertThat(*cache._lookup(hot) == first, Equals(false));
+			AssertThat(fetcher->release(), Equals(0u));
+			now += std::chrono::minutes(60); // both expired, neither past max_stale
+			AssertThat(cache._sweep(), Equals(0u));
+			now += std::chrono::minutes(61);
+			AssertThat(cache._sweep(), Equals(2u));
+			AssertThat(cache._lookup(other) == nullptr, Equals(true));
+		});
+		it("keeps the expiry queue bounded while one key churns", [&]() {
+			auto now = forecast_clock::from_time_t(SAMPLE_DATA_START);
+			expiry_policy expiry;
+			expiry.max_age = std::chrono::hours(1);
+			auto cache = LFU_cache_client(10, expiry, location_grid(), std::make_shared<failing_fetcher>());
+			cache.set_clock([&]() { return now; });
+			auto key = cache.get_grid().key(47.36, -122.19);
+			auto data = std::make_shared<const forecast_index>(synthetic_fetcher::forecast_for(47.36, -122.19, SAMPLE_DATA_START));
+			for (int i = 0; i < 1000; i++) {
+				cache._store(key, data);
+				now += std::chrono::seconds(1);
+			}
+			AssertThat(cache.size(), Equals(1u));
+			AssertThat(cache._expiry_records(), IsLessThan(100u));
+			now += std::chrono::minutes(59);
+			AssertThat(cache._sweep(), Equals(0u));
+			now += std::chrono::minutes(1);
+			AssertThat(cache._sweep(), Equals(1u));
+			AssertThat(cache._expiry_records(), Equals(0u));
+		});
+		it("refreshes the hottest entries ahead of expiry", [&]() {
+			auto now = forecast_clock::from_time_t(SAMPLE_DATA_START);
+			expiry_policy expiry;
+			expiry.max_age = std::chrono::hours(1);
+			auto cache = LFU_cache_client(10, expiry);
+			cache.set_clock([&]() { return now; });
+			cache.set_pair(45.62, -122.67);
+			auto cold = cache._get();
+			cache.set_pair(47.36, -122.19);
+			auto hot = cache._get();
+			cache._get();
+			now += std::chrono::minutes(50);
+			AssertThat(cache._refresh_hot(1, std::chrono::minutes(15)), Equals(1u));
+			cache._wait_refreshes();
+			AssertThat(cache._get() == hot, Equals(false));
+			cache.set_pair(45.62, -122.67);
+			AssertThat(cache._get() == cold, Equals(true));
+		});
+	});
+	describe("sharded_cache", []() {
+		it("serves concurrent queries", [&]() {
+			auto start = SAMPLE_DATA_START;
+			auto end = start + 25 * ONE_HOUR;
+			sharded_LFU_cache_client cache(10, 4);
+			vector<std::thread> threads;
+			std::atomic<int> correct(0);
+			for (int t = 0; t < 8; t++) {
+				threads.emplace_back([&, t]() {
+					for (int i = 0; i < 50; i++) {
+						auto data = t % 2 ? cache.query(47.36, -122.19, start, end)
+							: cache.query(45.62, -122.67, start, end);
+						correct += data.size() == 25;
+					}
+				});
+			}
+			for (auto &thread : threads)
+				thread.join();
+			AssertThat(correct.load(), Equals(400));
+			AssertThat(cache.size(), Equals(2u));
+		});
+		it("coalesces concurrent misses for one location", [&]() {
+			sharded_LFU_cache_client cache(10, 4);
+			vector<forecast_handle> results(8);
+			vector<std::thread> threads;
+			for (int t = 0; t < 8; t++)
+				threads.emplace_back([&, t]() { results[t] = cache._get(47.36, -122.19); });
+			for (auto &thread : threads)
+				thread.join();
+			for (auto &result : results)
+				AssertThat(result == results[0], Equals(true));
+		});
+		it("reports the fetch time to coalesced misses", [&]() {
+			auto fetcher = std::make_shared<deferred_fetcher>();
+			sharded_LFU_cache_client<> cache(10, 4, expiry_policy(), location_grid(), fetcher);
+			cache._get_async(47.36, -122.19, [](forecast_handle, std::exception_ptr) {});
+			forecast_clock::time_point coalesced, cached;
+			std::thread waiter([&]() { cache._get(47.36, -122.19, &coalesced); });
+			std::this_thread::sleep_for(std::chrono::milliseconds(50)); // let it join the fetch
+			auto released = forecast_clock::now();
+			AssertThat(fetcher->release(), Equals(1u));
+			waiter.join();
+			cache._get(47.36, -122.19, &cached);
+			AssertThat(coalesced == cached, Equals(true));
+			AssertThat(coalesced >= released, Equals(true));
+		});
+		it("stores forecasts that arrive already expired", [&]() {
+			auto start = SAMPLE_DATA_START;
+			expiry_policy expiry;
+			expiry.first_point_lag = std::chrono::hours(1); // the sample data is years behind the clock
+			sharded_LFU_cache_client<> cache(10, 2, expiry);
+			for (int i = 0; i < 2; i++) {
+				auto data = cache.query(47.36, -122.19, start, start + 25 * ONE_HOUR);
+				AssertThat(data.size(), Equals(25u));
+				AssertThat(data[0], Equals(290.18));
+				AssertThat(cache.size(), Equals(1u));
+			}
+			auto local = LFU_cache_client(10, expiry);
+			auto batch = local.query_batch({{47.36, -122.19}, {45.62, -122.67}}, start, start + 25 * ONE_HOUR);
+			AssertThat(batch.length(1), Equals(25u));
+			AssertThat(batch.series(0)[0], Equals(290.18));
+		});
+		it("completes async hits inline and misses when the fetch does", [&]() {
+			auto start = SAMPLE_DATA_START;
+			auto end = start + 25 * ONE_HOUR;
+			auto fetcher = std::make_shared<deferred_fetcher>();
+			sharded_LFU_cache_client<> cache(10, 4, expiry_policy(), location_grid(), fetcher);
+			int completed = 0;
+			auto check = [&](vector<double> values, std::exception_ptr error) {
+				AssertThat(error == nullptr, Equals(true));
+				AssertThat(values.size(), Equals(25u));
+				completed++;
+			};
+			cache.async_query(47.36, -122.19, start, end, check);
+			cache.async_query(47.36, -122.19, start, end, check);
+			auto waiting = cache.async_query(47.36, -122.19, start, end);
+			AssertThat(completed, Equals(0));
+			AssertThat(fetcher->release(), Equals(1u));
+			AssertThat(completed, Equals(2));
+			AssertThat(waiting.get().size(), Equals(25u));
+			auto hit = cache.async_query(47.36, -122.19, start, end);
+			AssertThat(hit.wait_for(std::chrono::seconds(0)) == std::future_status::ready, Equals(true));
+			AssertThat(fetcher->release(), Equals(0u));
+		});
+		it("runs async misses on the executor and passes errors on", [&]() {
+			auto fetcher = std::make_shared<deferred_fetcher>();
+			sharded_LFU_cache_client<> cache(10, 4, expiry_policy(), location_grid(), fetcher);
+			vector<std::function<void()>> posted;
+			cache.set_executor([&](std::function<void()> task) { posted.push_back(std::move(task)); });
+			std::exception_ptr failure;
+			cache.async_query(47.36, -122.19, SAMPLE_DATA_START, SAMPLE_DATA_START + ONE_DAY,
+				[&](vector<double>, std::exception_ptr error) { failure = error; });
+			auto blocked = cache.async_query(47.36, -122.19, SAMPLE_DATA_START, SAMPLE_DATA_START + ONE_DAY);
+			fetcher->release(true);
+			AssertThat(posted.size(), Equals(2u));
+			AssertThat(failure == nullptr, Equals(true));
+			for (auto &task : posted)
+				task();
+			AssertThat(failure == nullptr, Equals(false));
+			AssertThrows(std::runtime_error, blocked.get());
+			AssertThat(cache.size(), Equals(0u));
+		});
+	});
+	describe("forecast_index", []() {
+		it("resamples metric columns like the temperature", [&]() {
+			vector<int32_t> dt = {100, 200, 307, 400};
+			vector<double> temp = {280.5, 281.25, 279.0, 283.0}, humidity = {40, 55, 61, 38}, wind = {1.5, 0.25, 3.0, 2.125};
+			forecast_index index(dt, temp);
+			AssertThrows(std::invalid_argument, index.set_metric(metric::humidity, {1.0}));
+			AssertThrows(std::invalid_argument, index.set_metric(metric::temperature, temp));
+			index.set_metric(metric::wind_speed, wind);
+			index.set_metric(metric::humidity, humidity);
+			AssertThat(index.metrics(), Equals(metric::temperature | metric::humidity | metric::wind_speed));
+			AssertThat(index.column(metric::precipitation) == nullptr, Equals(true));
+			for (auto mode : {resample_mode::nearest, resample_mode::linear}) {
+				auto series = resample_metrics(index, metric::all, 50, 450, 7, mode);
+				AssertThat(series.metrics, Equals(index.metrics()));
+				for (auto column : {std::make_pair(metric::temperature, temp), std::make_pair(metric::humidity, humidity),
+						std::make_pair(metric::wind_speed, wind)}) {
+					auto expected = resample(forecast_index(dt, column.second), 50, 450, 7, mode);
+					AssertThat(series.length, Equals(expected.size()));
+					for (size_t k = 0; k < expected.size(); k++)
+						AssertThat(series.series(column.first)[k], Equals(expected[k]));
+				}
+			}
+			std::string encoded;
+			index.encode(encoded);
+			const char *p = encoded.data();
+			forecast_index decoded;
+			AssertThat(forecast_index::decode(p, encoded.data() + encoded.size(), decoded), Equals(true));
+			AssertThat(decoded.metrics(), Equals(index.metrics()));
+			AssertThat((*decoded.column(metric::wind_speed))[3], Equals(2.125));
+		});
+		it("resamples to the nearest point in one pass", [&]() {
+			auto index = forecast_index::from_points({{300, 3.0}, {100, 1.0}, {200, 2.0}, {200, 9.0}});
+			AssertThat(index.size(), Equals(3u));
+			auto data = resample(index, 50, 400, 50);
+			// 50 precedes the first point, 150 and 250 are ties and 350 is past the last point
+			AssertThat(data.size(), Equals(6u));
+			AssertThat(data[0], Equals(1.0));
+			AssertThat(data[1], Equals(1.0));
+			AssertThat(data[2], Equals(2.0));
+			AssertThat(data[3], Equals(2.0));
+			AssertThat(data[4], Equals(3.0));
+			AssertThat(data[5], Equals(3.0));
+		});
+		it("matches a per-sample nearest search", [&]() {
+			auto index = forecast_index::from_points({{1000, 1.5}, {1100, -2.0}, {1107, 4.0}, {1400, 8.25}, {1403, 0.5}});
+			for (int granularity : {1, 3, 7, 60}) {
+				for (int start = 900; start < 1500; start += 13) {
+					auto data = resample(index, start, start + 500, granularity);
+					size_t k = 0;
+					for (int i = start; i < start + 500; i += granularity) {
+						size_t j = 0;
+						while (j < index.size() && index.time(j) < i)
+							j++;
+						if (j == index.size())
+							break;
+						if (j > 0 && (i - index.time(j - 1)) < (index.time(j) - i))
+							j--;
+						AssertThat(data[k++], Equals(index.temperature(j)));
+					}
+					AssertThat(data.size(), Equals(k));
+				}
+			}
+		});
+		it("packs evenly spaced two decimal points", [&]() {
+			vector<int32_t> dt;
+			vector<double> temp;
+			for (int k = 0; k < 40; k++) {
+				dt.push_back(SAMPLE_DATA_START + k * 3 * ONE_HOUR);
+				temp.push_back(std::round((270.0 + k * 0.37 - (k % 3) * 10.01) * 100) / 100); // as parsed from two decimals
+			}
+			forecast_index index(dt, temp);
+			AssertThat(index.compact(), Equals(true));
+			AssertThat(index.size_bytes(), IsLessThan(sizeof(forecast_index) + 40 * 3));
+			for (size_t k = 0; k < 40; k++) {
+				AssertThat(index.time(k), Equals(dt[k]));
+				AssertThat(index.temperature(k), Equals(temp[k]));
+			}
+			dt[7] += 60;
+			temp[3] = 281.125;
+			forecast_index irregular(dt, temp);
+			AssertThat(irregular.compact(), Equals(false));
+			AssertThat(irregular.time(7), Equals(dt[7]));
+			AssertThat(irregular.temperature(3), Equals(281.125));
+		});
+		it("interpolates linearly between points", [&]() {
+			auto index = forecast_index::from_points({{100, 1.0}, {200, 3.0}, {300, 2.0}});
+			auto data = resample(index, 50, 1000, 25, resample_mode::linear);
+			AssertThat(data.size(), Equals(11u));
+			AssertThat(data[0], Equals(1.0));
+			AssertThat(data[2], Equals(1.0));
+			AssertThat(data[3], EqualsWithDelta(1.5, 1e-9));
+			AssertThat(data[6], Equals(3.0));
+			AssertThat(data[8], EqualsWithDelta(2.5, 1e-9));
+			AssertThat(data[10], Equals(2.0));
+		});
+	});
+	describe("eviction_policies", []() {
+		it("keep hit rates comparable on a zipf workload", [&]() {
+			auto trace = zipf_trace(50000, 2000, 7);
+			double lru = replay_hit_rate<lru_policy>(trace, 200);
+			for (double rate : {replay_hit_rate<lfu_policy>(trace, 200),
+					replay_hit_rate<aging_lfu_policy>(trace, 200),
+					replay_hit_rate<w_tinylfu_policy>(trace, 200),
+					replay_hit_rate<arc_policy>(trace, 200)}) {
+				AssertThat(rate, IsGreaterThan(lru * 0.9));
+				AssertThat(rate, IsLessThan(0.9));
+			}
+		});
+		it("let aging LFU forget a hot set that went cold", [&]() {
+			vector<int> trace;
+			for (int round = 0; round < 1000; round++)
+				for (int key = 0; key < 10; key++)
+					trace.push_back(key);
+			for (int round = 0; round < 300; round++)
+				for (int key = 100; key < 108; key++)
+					trace.push_back(key);
+			double lfu = replay_hit_rate<lfu_policy>(trace, 10);
+			double aging = replay_hit_rate<aging_lfu_policy>(trace, 10);
+			AssertThat(aging, IsGreaterThan(lfu + 0.1));
+		});
+		it("survive random churn", [&]() {
+			std::mt19937 random(3);
+			vector<int> trace;
+			for (int i = 0; i < 20000; i++)
+				trace.push_back(random() % (i < 10000 ? 50 : 500));
+			replay_hit_rate<lru_policy>(trace, 32);
+			replay_hit_rate<lfu_policy>(trace, 32);
+			replay_hit_rate<aging_lfu_policy>(trace, 32);
+			replay_hit_rate<w_tinylfu_policy>(trace, 32);
+			replay_hit_rate<arc_policy>(trace, 32);
+			replay_hit_rate<arc_policy>(trace, 1);
+			replay_hit_rate<w_tinylfu_policy>(trace, 1);
+		});
+	});
+	describe("location_key", []() {
+		it("packs grid cells into one integer", [&]() {
+			location_grid grid(0.01);
+			AssertThat(grid.key(47.36, -122.19) == grid.key(47.364, -122.186), Equals(true));
+			AssertThat(grid.key(47.36, -122.19) == grid.key(47.37, -122.19), Equals(false));
+			AssertThat(grid.key(-47.36, 122.19) == grid.key(47.36, -122.19), Equals(false));
+			auto center = grid.center(grid.key(-33.8688, 151.2093));
+			AssertThat(center.first, Equals(-33.87));
+			AssertThat(center.second, Equals(151.21));
+		});
+	});
+	describe("forecast_parser", []() {
+		it("extracts dt and main.temp only", [&]() {
+			auto index = parse_forecast(R"({"cod":"200","cnt":2,"list":[
+				{"dt":100,"main":{"temp":280.5,"humidity":60},"weather":[{"id":1,"main":"Rain"}],"dt_txt":"x"},
+				{"main":{"feels_like":1.5,"temp":281},"dt":200,"wind":{"dt":7}}],
+				"city":{"dt":5,"main":{"temp":1}}})");
+			AssertThat(index.size(), Equals(2u));
+			AssertThat(index.time(0), Equals(100));
+			AssertThat(index.temperature(0), Equals(280.5));
+			AssertThat(index.time(1), Equals(200));
+			AssertThat(index.temperature(1), Equals(281.0));
+		});
+		it("rejects responses without a forecast", [&]() {
+			AssertThrows(std::runtime_error, parse_forecast(R"({"cod":"404","message":"city not found"})"));
+			AssertThrows(std::runtime_error, parse_forecast(R"({"cnt":1,"list":[{"dt":1)"));
+		});
+		it("does not trust cnt for how much to allocate", [&]() {
+			auto index = parse_forecast(R"({"cnt":1e18,"list":[{"dt":100,"main":{"temp":280.5}}]})");
+			AssertThat(index.size(), Equals(1u));
+			AssertThat(index.temperature(0), Equals(280.5));
+		});
+	});
+	describe("forecast_fetcher", []() {
+		it("fetches concurrently over persistent connections", [&]() {
+			fetcher_options options;
+			options.max_connections = 2;
+			http_forecast_fetcher fetcher(options);
+			vector<std::future<forecast_handle>> pending;
+			for (int i = 0; i < 6; i++)
+				pending.push_back(i % 2 ? fetcher.fetch_future(47.36, -122.19) : fetcher.fetch_future(45.62, -122.67));
+			for (auto &result : pending)
+				AssertThat(result.get()->size(), Equals(40u));
+		});
+		it("reports failed requests", [&]() {
+			http_forecast_fetcher fetcher;
+			AssertThrows(std::runtime_error, fetcher.fetch(0.5, 0.5));
+		});
+	});
+	describe("lfu_cache", []() {
+		it("evicts the least frequently used, oldest on a tie", [&]() {
+			lfu_cache<int, int> lfu(3);
+			lfu.insert(1, 10);
+			lfu.insert(2, 20);
+			lfu.insert(3, 30);
+			lfu.find(1);
+			lfu.find(3);
+			lfu.insert(4, 40); // 2 is the only entry left at frequency 1
+			AssertThat(lfu.contains(2), Equals(false));
+			AssertThat(lfu.frequency(1), Equals(2u));
+			lfu.find(4);
+			lfu.insert(5, 50); // 1, 3 and 4 tie at frequency 2, 1 got there first
+			AssertThat(lfu.contains(1), Equals(false));
+			AssertThat(lfu.contains(3), Equals(true));
+			AssertThat(*lfu.find(4), Equals(40));
+			AssertThat(lfu.size(), Equals(3u));
+		});
+		it("evicts around an entry that outgrew the byte budget", [&]() {
+			typedef policy_cache<int, int, lru_policy> cache_type;
+			cache_type lru(100, 5 * (cache_type::ENTRY_OVERHEAD + 1000));
+			for (int key = 1; key <= 4; key++)
+				lru.insert(key, key * 10, 1000);
+			lru.resize(1, 2500); // 1 is the least recent, the policy's victim
+			AssertThat(lru.bytes_used(), IsLessThanOrEqualTo(lru.max_bytes_used()));
+			AssertThat(lru.contains(1), Equals(true));
+			AssertThat(lru.contains(2), Equals(false));
+			AssertThat(*lru.find(3), Equals(30));
+		});
+		it("keeps policies sized for the entries a byte budget holds", [&]() {
+			std::mt19937 random(5);
+			policy_cache<int, int, w_tinylfu_policy> tinylfu(1000000, 1 << 20);
+			policy_cache<int, int, arc_policy> arc(1000000, 1 << 20);
+			for (int i = 0; i < 20000; i++) {
+				int key = random() % (i < 10000 ? 200 : 2000);
+				size_t bytes = i < 10000 ? 2000 : 200; // entries shrink halfway, more of them fit
+				if (int *value = tinylfu.find(key))
+					AssertThat(*value, Equals(key * 10));
+				else
+					tinylfu.insert(key, key * 10, bytes);
+				if (int *value = arc.find(key))
+					AssertThat(*value, Equals(key * 10));
+				else
+					arc.insert(key, key * 10, bytes);
+				AssertThat(tinylfu.bytes_used(), IsLessThanOrEqualTo(tinylfu.max_bytes_used()));
+				AssertThat(arc.bytes_used(), IsLessThanOrEqualTo(arc.max_bytes_used()));
+			}
+			AssertThat(arc.size(), IsGreaterThan(1000u));
+		});
 	});
 
-});
-
-void run_performance_tests(){
-	const int SAMPLE_DATA_START = 1659722400;
-	
-	// Non-Cache Speed Performance 
-        auto start = SAMPLE_DATA_START;
-        auto end = start + 25 * ONE_HOUR;
-        auto client = NonCachingClient(47.36, -122.19);
-        auto data = client.query(start, end);
-	auto start_time = high_resolution_clock::now();
-
-	for(int i = 0; i < 3000; i++){
-		client = NonCachingClient(47.36, -122.19);
-		data = client.query(start, end);
-	}
-	auto stop = high_resolution_clock::now();
-	auto duration = duration_cast<microseconds>(stop - start_time);
-        cout << "________________________________________" << endl;
-	cout << "Non-Cache Client performance on 3000 queries: " <<  duration.count() << " microseconds" << endl;
-	auto temp = duration;
+	describe("node_routing", []() {
+		it("spreads keys evenly and moves few on rebalancing", [&]() {
+			hash_ring ring;
+			for (auto node : {"a", "b", "c"})
+				ring.add_node(node, 128);
+			std::map<std::string, int> counts;
+			vector<std::string> before;
+			location_grid grid;
+			for (int i = 0; i < 30000; i++) {
+				before.push_back(ring.owner(grid.key(40 + (i % 200) * 0.01, -120 + (i / 200) * 0.01)));
+				counts[before.back()]++;
+			}
+			for (auto &count : counts)
+				AssertThat(count.second, IsGreaterThan(6000));
+			ring.add_node("d", 128);
+			int moved = 0;
+			for (int i = 0; i < 30000; i++) {
+				auto &now = ring.owner(grid.key(40 + (i % 200) * 0.01, -120 + (i / 200) * 0.01));
+				if (now != before[i]) {
+					AssertThat(now, Equals(std::string("d")));
+					moved++;
+				}
+			}
+			AssertThat(moved, IsGreaterThan(3000));
+			AssertThat(moved, IsLessThan(12000));
+		});
+		it("forwards keys to their owner node", [&]() {
+			auto transport = std::make_shared<in_process_transport>();
+			routed_cache_client<> a("a", transport, 10, 64, 2);
+			routed_cache_client<> b("b", transport, 10, 64, 2);
+			transport->attach("a", [&](double lat, double lon) { return a.serve(lat, lon); });
+			transport->attach("b", [&](double lat, double lon) { return b.serve(lat, lon); });
+			a.add_node("b");
+			b.add_node("a");
+			AssertThat(a.owner(47.36, -122.19), Equals(b.owner(47.36, -122.19)));
+			auto &owner = a.owner(47.36, -122.19) == "a" ? a : b;
+			auto &other = &owner == &a ? b : a;
+			AssertThat(other._get(47.36, -122.19)->temperature(0), Equals(290.18));
+			AssertThat(owner.local_cache().size(), Equals(1u));
+			AssertThat(other.local_cache().size(), Equals(0u));
+			transport->detach(owner.owner(47.36, -122.19));
+			other._get(47.36, -122.19); // owner unreachable, served locally
+			AssertThat(other.local_cache().size(), Equals(1u));
+		});
+		it("answers forwarded requests with the original fetch time", [&]() {
+			std::string path = "/tmp/forecast_routed_snapshot_test.bin";
+			auto fetched = forecast_clock::now() - std::chrono::hours(2);
+			{
+				auto cache = LFU_cache_client(10);
+				cache.set_clock([&]() { return fetched; });
+				cache.set_pair(47.36, -122.19);
+				cache._get();
+				cache.save_snapshot(path);
+			}
+			routed_cache_client<> node("a", std::make_shared<in_process_transport>(), 10, 64, 2,
+				expiry_policy(), location_grid(), std::make_shared<failing_fetcher>());
+			AssertThat(node.local_cache().load_snapshot(path), Equals(true));
+			int64_t fetched_at;
+			auto data = decode_tier_value(node.serve(47.36, -122.19), fetched_at);
+			AssertThat(data->temperature(0), Equals(290.18));
+			AssertThat(fetched_at, Equals((int64_t)forecast_clock::to_time_t(fetched)));
+			std::remove(path.c_str());
+		});
+	});
 
-	// Cache Speed Performance
-        auto start_cache = SAMPLE_DATA_START;
-        auto end_cache = start_cache + 25 * ONE_HOUR;
-        auto cache = LFU_cache_client(10);
-        cache.set_pair(47.36, -122.19);
-        auto data_cache = cache.query(start_cache, end_cache);
+	describe("forecast_tier", []() {
+		it("round trips the compact value format", [&]() {
+			auto even = forecast_index::from_points({{100, 280.25}, {200, 281.5}, {300, 279.0}});
+			auto odd = forecast_index::from_points({{100, 1.125}, {250, -3.0}, {300, 2.0}});
+			for (auto *index : {&even, &odd}) {
+				int64_t fetched_at;
+				auto value = encode_tier_value(*index, 1234);
+				auto decoded = decode_tier_value(value, fetched_at);
+				AssertThat(decoded != nullptr, Equals(true));
+				AssertThat(fetched_at, Equals(1234));
+				AssertThat(decoded->size(), Equals(3u));
+				for (size_t k = 0; k < 3; k++) {
+					AssertThat(decoded->time(k), Equals(index->time(k)));
+					AssertThat(decoded->temperature(k), Equals(index->temperature(k)));
+				}
+				AssertThat(decode_tier_value(value.substr(0, value.size() - 1), fetched_at) == nullptr, Equals(true));
+			}
+		});
+		it("lets a second client skip the upstream fetch", [&]() {
+			auto tier = std::make_shared<memory_forecast_tier>();
+			auto first = LFU_cache_client(10, expiry_policy(), location_grid(), std::make_shared<tiered_fetcher>(tier));
+			first.set_pair(47.36, -122.19);
+			first._get();
+			AssertThat(tier->size(), Equals(1u));
+			auto second = LFU_cache_client(10, expiry_policy(), location_grid(),
+				std::make_shared<tiered_fetcher>(tier, std::make_shared<failing_fetcher>()));
+			second.set_pair(47.36, -122.19);
+			AssertThat(second._get()->temperature(0), Equals(290.18));
+			AssertThat(second._get()->metrics(), Equals(metric::all));
+			second.set_pair(45.62, -122.67);
+			AssertThrows(std::runtime_error, second._get());
+		});
+		it("only serves values the client can still keep for its max_age", [&]() {
+			auto tier = std::make_shared<memory_forecast_tier>();
+			tier_options options;
+			options.ttl_seconds = 3 * ONE_HOUR;
+			options.client_max_age_seconds = ONE_HOUR;
+			auto fetcher = std::make_shared<tiered_fetcher>(tier, std::make_shared<failing_fetcher>(), location_grid(), options);
+			auto index = forecast_index::from_points({{100, 280.25}, {200, 281.5}});
+			int64_t now = (int64_t)forecast_clock::to_time_t(forecast_clock::now());
+			tier->put(fetcher->tier_key(47.36, -122.19), encode_tier_value(index, now - 90 * 60), 0);
+			tier->put(fetcher->tier_key(45.62, -122.67), encode_tier_value(index, now - 150 * 60), 0);
+			AssertThat(fetcher->fetch(47.36, -122.19)->size(), Equals(2u));
+			AssertThrows(std::runtime_error, fetcher->fetch(45.62, -122.67)); // would be served 3.5 hours after the fetch
+		});
+		it("keeps slow tier lookups off the shard lock", [&]() {
+			auto tier = std::make_shared<slow_forecast_tier>();
+			expiry_policy expiry;
+			expiry.first_point_lag = std::chrono::hours(1); // stale on arrival, so every hit refreshes
+			expiry.stale_while_revalidate = true;
+			sharded_LFU_cache_client<> cache(10, 1, expiry, location_grid(),
+				std::make_shared<tiered_fetcher>(tier, std::make_shared<synthetic_fetcher>()));
+			auto first = cache._get(47.36, -122.19), second = cache._get(45.62, -122.67);
+			tier->close();
+			auto stale = std::async(std::launch::async, [&]() { return cache._get(47.36, -122.19); });
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+			while (!tier->lookups_waiting() && std::chrono::steady_clock::now() < deadline)
+				std::this_thread::yield();
+			auto other = std::async(std::launch::async, [&]() { return cache._get(45.62, -122.67); });
+			auto served = stale.wait_until(deadline) == std::future_status::ready &&
+				other.wait_until(deadline) == std::future_status::ready;
+			tier->open();
+			AssertThat(served, Equals(true));
+			AssertThat(stale.get() == first, Equals(true)); // the refresh is still looking in the tier
+			AssertThat(other.get() == second, Equals(true));
+		});
+	});
 
-        start_time = high_resolution_clock::now();
-	for(int i = 0; i < 3000; i++){
-		cache.set_pair(47.36, -122.19);
-		data_cache = cache.query(start_cache, end_cache);
-	}
-        stop = high_resolution_clock::now();
-        duration = duration_cast<microseconds>(stop - start_time);
-        cout << "Cache Client performance on 3000 queries: " <<  duration.count() << " microseconds" << endl;
+	describe("metrics", []() {
+		it("buckets latencies within an eighth of their value", [&]() {
+			latency_histogram histogram;
+			for (uint64_t v : {0ull, 7ull, 8ull, 1000ull, 123456789ull, ~0ull}) {
+				auto bucket = latency_histogram::bucket_for(v);
+				AssertThat(bucket, IsLessThan(latency_histogram::BUCKETS));
+				AssertThat(latency_histogram::upper_bound(bucket), IsGreaterThanOrEqualTo(v));
+				AssertThat((double)latency_histogram::upper_bound(bucket), IsLessThanOrEqualTo((double)v * 1.125 + 1));
+			}
+			for (uint64_t v = 1; v <= 1000; v++)
+				histogram.record(v * 1000);
+			auto snapshot = histogram.snapshot();
+			AssertThat(snapshot.count, Equals(1000u));
+			AssertThat((double)snapshot.percentile(0.5), EqualsWithDelta(500000.0, 500000.0 * 0.125));
+			AssertThat((double)snapshot.percentile(0.99), EqualsWithDelta(990000.0, 990000.0 * 0.125));
+		});
+		it("counts hits, misses, evictions and expirations", [&]() {
+			auto now = forecast_clock::from_time_t(SAMPLE_DATA_START);
+			expiry_policy expiry;
+			expiry.max_age = std::chrono::hours(1);
+			auto metrics = std::make_shared<forecast_metrics>();
+			auto cache = LFU_cache_client(1, expiry);
+			cache.set_metrics(metrics);
+			cache.set_clock([&]() { return now; });
+			cache.set_pair(47.36, -122.19);
+			cache.query(SAMPLE_DATA_START, SAMPLE_DATA_START + ONE_DAY);
+			cache.query(SAMPLE_DATA_START, SAMPLE_DATA_START + ONE_HOUR);
+			cache.set_pair(45.62, -122.67);
+			cache._get();
+			now += std::chrono::hours(2);
+			cache._get();
+			auto snapshot = metrics->snapshot();
+			AssertThat(snapshot.hits, Equals(1u));
+			AssertThat(snapshot.misses, Equals(3u));
+			AssertThat(snapshot.evictions, Equals(1u));
+			AssertThat(snapshot.expirations, Equals(1u));
+			AssertThat(snapshot.resample.count, Equals(2u));
+			auto text = metrics->export_text();
+			AssertThat(text.find("forecast_cache_hits_total 1\n") != std::string::npos, Equals(true));
+			AssertThat(text.find("forecast_resample_seconds_count 2\n") != std::string::npos, Equals(true));
+		});
+	});
 
+	describe("pool_allocator", []() {
+		it("recycles freed slots before growing", [&]() {
+			::detail::slab_pool pool(24, 4);
+			void *first = pool.allocate();
+			void *second = pool.allocate();
+			pool.deallocate(first);
+			AssertThat(pool.allocate() == first, Equals(true));
+			for (int i = 0; i < 2; i++)
+				pool.allocate();
+			AssertThat(pool.reserved(), Equals(4u));
+			pool.allocate();
+			AssertThat(pool.reserved(), Equals(8u));
+			AssertThat(pool.in_use(), Equals(5u));
+			pool.deallocate(second);
+			AssertThat(pool.in_use(), Equals(4u));
+		});
+		it("backs node containers under churn", [&]() {
+			::detail::pool_allocator<int> slots;
+			std::list<int, ::detail::pool_allocator<int>> list(slots);
+			for (int i = 0; i < 100; i++)
+				list.push_back(i);
+			for (int round = 0; round < 1000; round++) {
+				list.pop_front();
+				list.push_back(round);
+			}
+			AssertThat(list.size(), Equals(100u));
+			AssertThat(list.front(), Equals(900));
+			AssertThat(list.get_allocator() == slots, Equals(true));
+		});
+	});
 
-	cout << "Cache Performs roughly "<<  temp/duration << " times faster than the non-cache client!" << endl;
-        cout << "________________________________________" << endl;
+	describe("admission", []() {
+		it("remembers recent keys in the doorkeeper", [&]() {
+			doorkeeper seen(100);
+			AssertThat(seen.insert(7), Equals(false));
+			AssertThat(seen.insert(7), Equals(true));
+			int false_positives = 0;
+			for (location_key key = 1000; key < 1099; key++)
+				false_positives += seen.contains(key);
+			AssertThat(false_positives, IsLessThan(10));
+			for (location_key key = 2000; key < 2200; key++)
+				seen.insert(key);
+			AssertThat(seen.contains(7), Equals(false)); // cleared once 100 more were added
+		});
+		it("keeps one-off misses out of a full cache", [&]() {
+			auto metrics = std::make_shared<forecast_metrics>();
+			LFU_cache_client<> cache(2, expiry_policy(), location_grid(), std::make_shared<synthetic_fetcher>());
+			cache.set_metrics(metrics);
+			cache.set_doorkeeper(64);
+			for (double lat : {10.0, 20.0}) {
+				cache.set_pair(lat, 0);
+				cache.view();
+			}
+			cache.set_pair(30, 0);
+			AssertThat(cache.query_window(SAMPLE_DATA_START, SAMPLE_DATA_START + ONE_DAY)->size(), Equals(24u));
+			AssertThat(metrics->rejections.value(), Equals(1u));
+			AssertThat(metrics->evictions.value(), Equals(0u));
+			cache.view();
+			AssertThat(metrics->evictions.value(), Equals(1u));
+			cache.view();
+			AssertThat(metrics->hits.value(), Equals(1u));
+		});
+		it("limits upstream requests and reserves tokens for hot keys", [&]() {
+			auto now = std::chrono::steady_clock::now();
+			auto upstream = std::make_shared<synthetic_fetcher>();
+			rate_limit limit;
+			limit.per_second = 1;
+			limit.burst = 3;
+			limit.hot_reserve = 1;
+			rate_limited_fetcher fetcher(upstream, limit);
+			fetcher.set_clock([&]() { return now; });
+			fetcher.fetch(10, 0);
+			fetcher.fetch(20, 0);
+			AssertThrows(rate_limited_error, fetcher.fetch(30, 0));
+			fetcher.fetch(10, 0); // hot, takes the reserve
+			AssertThrows(rate_limited_error, fetcher.fetch(10, 0));
+			AssertThat(upstream->request_count(), Equals(3u));
+			now += std::chrono::seconds(2);
+			fetcher.fetch(30, 0);
+			AssertThat(fetcher.rejections(), Equals(2u));
+		});
+	});
+	describe("forecast_pipeline", []() {
+		it("picks granularities at compile time", [&]() {
+			static_assert(default_granularity::for_range(0, TWO_HOURS - 1) == MINUTE, "short ranges by the minute");
+			static_assert(resample_stage<fixed_granularity<ONE_HOUR>>::granularity(0, MINUTE) == ONE_HOUR, "fixed spacing");
+			auto start = SAMPLE_DATA_START;
+			LFU_cache_client<lfu_policy, resample_stage<fixed_granularity<ONE_HOUR>>> hourly(10);
+			hourly.set_pair(47.36, -122.19);
+			AssertThat(hourly.query(start, start + TWO_HOURS).size(), Equals(2u));
+			sharded_LFU_cache_client<lfu_policy, resample_stage<fixed_granularity<3 * ONE_HOUR>>> sharded(10, 2);
+			auto data = sharded.query(47.36, -122.19, start, start + ONE_DAY);
+			AssertThat(data.size(), Equals(8u));
+			AssertThat(data[1], Equals(294.06));
+		});
+		it("gives the same results over a concrete fetcher", [&]() {
+			auto fetcher = std::make_shared<synthetic_fetcher>();
+			auto metrics = std::make_shared<forecast_metrics>();
+			basic_non_caching_client<synthetic_fetcher> direct(47.36, -122.19, fetcher);
+			direct.set_metrics(metrics);
+			NonCachingClient dynamic(47.36, -122.19, fetcher);
+			for (auto mode : {resample_mode::nearest, resample_mode::linear}) {
+				auto expected = dynamic.query(SAMPLE_DATA_START, SAMPLE_DATA_START + 25 * ONE_HOUR, mode);
+				AssertThat(direct.query(SAMPLE_DATA_START, SAMPLE_DATA_START + 25 * ONE_HOUR, mode) == expected, Equals(true));
+			}
+			AssertThat(fetcher->request_count(), Equals(4u));
+			AssertThat(metrics->resample.snapshot().count, Equals(2u));
+			double out[4];
+			AssertThat(direct.query(SAMPLE_DATA_START, SAMPLE_DATA_START + ONE_DAY, out, 4), Equals(24u));
+			AssertThat(direct.query_metrics(metric::all, SAMPLE_DATA_START, SAMPLE_DATA_START + ONE_DAY).metrics,
+				Equals(metric::temperature));
+		});
+		it("puts the cache layer between a concrete fetcher and the stages", [&]() {
+			auto start = SAMPLE_DATA_START, end = start + 25 * ONE_HOUR;
+			auto fetcher = std::make_shared<synthetic_fetcher>();
+			NonCachingClient reference(47.36, -122.19, fetcher);
+			auto expected = reference.query(start, end);
+			cached_pipeline<lfu_policy, resample_stage<>, synthetic_fetcher> cached(10, expiry_policy(), location_grid(), fetcher);
+			AssertThat(cached.query(47.36, -122.19, start, end) == expected, Equals(true));
+			AssertThat(cached.query(47.36, -122.19, start, end) == expected, Equals(true));
+			AssertThat(cached.source().size(), Equals(1u));
+			sharded_LFU_cache_client<lfu_policy, resample_stage<>, synthetic_fetcher> sharded(10, 2, expiry_policy(), location_grid(), fetcher);
+			AssertThat(sharded.query(47.36, -122.19, start, end) == expected, Equals(true));
+			auto pending = sharded.async_query(45.62, -122.67, start, end);
+			AssertThat(pending.get().size(), Equals(25u));
+			AssertThat(fetcher->request_count(), Equals(4u)); // one per client and location, hits are not refetched
+			routed_cache_client<lfu_policy, resample_stage<>, synthetic_fetcher> node("a", std::make_shared<in_process_transport>(),
+				10, 64, 2, expiry_policy(), location_grid(), fetcher);
+			double out[32];
+			AssertThat(node.query(47.36, -122.19, start, end, out, 32), Equals(25u));
+			AssertThat(std::equal(expected.begin(), expected.end(), out), Equals(true));
+		});
+	});
+	describe("trace_replay", []() {
+		it("reads trace records and rejects malformed lines", [&]() {
+			std::istringstream good("# timestamp,lat,lon,start,end\n"
+				"1659722400,47.36,-122.19,1659722400,1659808800\n\n"
+				"1659722460,45.62,-122.67,1659722400,1659730000\n");
+			auto trace = read_trace(good);
+			AssertThat(trace.size(), Equals(2u));
+			AssertThat(trace[1].timestamp, Equals(1659722460));
+			AssertThat(trace[1].lon, Equals(-122.67));
+			AssertThat(trace[1].end, Equals(1659730000));
+			std::istringstream bad("1659722400,47.36,-122.19,1659722400,1659808800\n1659722400,47.36\n");
+			AssertThrows(std::runtime_error, read_trace(bad));
+		});
+		it("sweeps policies and capacities in parallel", [&]() {
+			vector<trace_record> trace;
+			auto ids = zipf_trace(20000, 2000, 5);
+			for (size_t i = 0; i < ids.size(); i++) {
+				int64_t now = SAMPLE_DATA_START + (int64_t)i / 4;
+				trace.push_back({now, 30 + (ids[i] % 50) * 0.05, -120 + (ids[i] / 50) * 0.05,
+					(int32_t)now, (int32_t)now + ONE_DAY});
+			}
+			replay_options options;
+			options.expiry.max_age = std::chrono::minutes(30);
+			vector<size_t> capacities = {16, 128, 1024};
+			auto policies = builtin_replay_policies();
+			auto results = sweep(trace, policies, capacities, options, 3);
+			AssertThat(results.size(), Equals(policies.size() * capacities.size()));
+			for (size_t i = 0; i < results.size(); i++) {
+				auto &r = results[i];
+				AssertThat(r.policy, Equals(policies[i / capacities.size()].name));
+				AssertThat(r.capacity, Equals(capacities[i % capacities.size()]));
+				AssertThat(r.hits + r.misses, Equals(trace.size()));
+				AssertThat(r.upstream, Equals(r.misses));
+				AssertThat(r.duration, Equals(trace.back().timestamp - trace.front().timestamp));
+				if (i % capacities.size())
+					AssertThat(r.hit_rate(), IsGreaterThan(results[i - 1].hit_rate()));
+			}
+			AssertThat(results.back().expirations, IsGreaterThan(0u));
+			auto serial = sweep(trace, {policies[1]}, {128}, options, 1);
+			AssertThat(serial[0].hits, Equals(results[4].hits));
+		});
+	});
 
-}
+});
 
 int main(int argc, char *argv[])
 {
-	run_performance_tests();
 	return bandit::run(argc, argv);
 }
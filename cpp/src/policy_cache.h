@@ -0,0 +1,253 @@
+/*
+ * @file policy_cache.h
+ *
+ * Fixed capacity cache with a pluggable eviction policy.
+ *
+ * Entries live in a hash map keyed by the cache key, so lookups never walk a
+ * tree. Every entry embeds the policy's node, which the policy links into
+ * whatever ordering it maintains (see eviction_policies.h). When the cache is
+ * full the policy names the entry to evict before a new one goes in, so no
+ * policy costs more than a hash lookup plus its own constant time work.
+ *
+ * Capacity is a number of entries, a number of bytes, or both. For the byte
+ * budget every entry is charged what the caller says its value holds plus
+ * the cache's own per-entry overhead (entry, policy node, hash node), and
+ * victims are evicted until the newcomer fits. The policy is then sized for
+ * the entries that fit the budget at their current average size rather than
+ * for the entry limit, and resized whenever that estimate doubles or halves.
+ *
+ * Entries are allocated from the cache's own slab pool (see pool_allocator.h),
+ * so eviction returns the slot to a free list the next insert takes it from.
+ */
+#ifndef POLICY_CACHE_H
+#define POLICY_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "eviction_policies.h"
+#include "pool_allocator.h"
+
+template <typename Key, typename Value, template <typename, typename> class Policy = lfu_policy,
+	typename Hash = std::hash<Key>>
+class policy_cache {
+
+	typedef Policy<Key, Hash> policy_type;
+	typedef typename policy_type::node node;
+
+	struct entry : node {
+		Key key;
+		Value value;
+		std::size_t bytes; // charged against max_bytes, overhead included
+
+		entry(const Key &key, Value value, std::size_t bytes)
+			: key(key), value(std::move(value)), bytes(bytes) {};
+	};
+
+	std::size_t capacity;
+	std::size_t max_bytes; // 0 for no byte budget
+	std::size_t used_bytes = 0;
+	std::size_t policy_capacity; // entries the policy is sized for
+	uint64_t evicted = 0;
+	std::unordered_map<Key, entry, Hash, std::equal_to<Key>,
+		detail::pool_allocator<std::pair<const Key, entry>>> entries; // node based, entries never move, evicted nodes are recycled
+	policy_type policy;
+
+	static entry &_entry(node *n) { return static_cast<entry &>(*n); }
+
+	void _evict(const Key *incoming){
+		_evict_entry(_entry(policy.victim(incoming)));
+	}
+
+	void _evict_entry(entry &victim){
+		Key key = victim.key;
+		policy.on_erase(victim, true);
+		used_bytes -= victim.bytes;
+		entries.erase(key);
+		evicted++;
+	}
+
+	bool _over_budget(std::size_t extra) const {
+		return max_bytes && used_bytes + extra > max_bytes;
+	}
+
+	// evicts until the budget holds, but never keep itself. Once keep is
+	// the policy's victim the others go coldest first, in the reverse of
+	// the policy's for_each_hottest() order.
+
+	void _shrink(const Key &keep){
+		while (entries.size() > 1 && _over_budget(0)) {
+			entry &victim = _entry(policy.victim(nullptr));
+			if (victim.key != keep) {
+				_evict_entry(victim);
+				continue;
+			}
+			std::vector<entry *> order;
+			policy.for_each_hottest([&](node &n) {
+				order.push_back(&_entry(&n));
+				return true;
+			});
+			for (auto it = order.rbegin(); it != order.rend() && _over_budget(0); ++it)
+				if ((*it)->key != keep)
+					_evict_entry(**it);
+			return;
+		}
+	}
+
+	// resizes the policy for the entries that fit the byte budget at the
+	// current average entry size, once that is off by a factor of two
+
+	void _fit_policy(){
+		if (!max_bytes || entries.empty())
+			return;
+		double average = (double)used_bytes / (double)entries.size();
+		std::size_t fit = std::max<std::size_t>(1, std::min<std::size_t>(capacity, (std::size_t)((double)max_bytes / average)));
+		if (fit > 2 * policy_capacity || 2 * fit < policy_capacity) {
+			policy.resize(fit);
+			policy_capacity = fit;
+		}
+	}
+
+	public:
+
+	// per-entry bytes the cache itself uses on top of the value's contents
+	static constexpr std::size_t ENTRY_OVERHEAD = sizeof(entry) + 2 * sizeof(void *);
+
+	// what an entry is guessed to hold under a byte budget until there are some
+	static constexpr std::size_t GUESSED_ENTRY_BYTES = 1024;
+
+	policy_cache(std::size_t capacity, std::size_t max_bytes = 0)
+		: capacity(capacity), max_bytes(max_bytes),
+		  policy_capacity(max_bytes ? std::max<std::size_t>(1, std::min(capacity, max_bytes / (ENTRY_OVERHEAD + GUESSED_ENTRY_BYTES))) : capacity),
+		  policy(policy_capacity) {};
+	policy_cache(const policy_cache &) = delete;
+	policy_cache &operator=(const policy_cache &) = delete;
+	~policy_cache() { clear(); }
+
+	// returns the cached value and counts the access, or null on a miss
+
+	Value *find(const Key &key){
+		policy.record(key);
+		auto it = entries.find(key);
+		if (it == entries.end())
+			return nullptr;
+		policy.on_hit(it->second);
+		return &it->second.value;
+	}
+
+	// returns the cached value without counting an access
+
+	Value *peek(const Key &key){
+		auto it = entries.find(key);
+		return it == entries.end() ? nullptr : &it->second.value;
+	}
+
+	// inserts a new entry, evicting the policy's victims first until there
+	// is room for it. bytes is what the value holds beyond sizeof(Value), it
+	// only matters with a byte budget. An entry larger than the whole budget
+	// is still cached, alone. Inserting an existing key replaces its value in
+	// place.
+
+	Value &insert(const Key &key, Value value, std::size_t bytes = 0){
+		bytes += ENTRY_OVERHEAD;
+		auto it = entries.find(key);
+		if (it != entries.end()) {
+			it->second.value = std::move(value);
+			used_bytes = used_bytes - it->second.bytes + bytes;
+			it->second.bytes = bytes;
+			_shrink(key);
+			_fit_policy();
+			return it->second.value;
+		}
+		while (!entries.empty() && (entries.size() >= capacity || _over_budget(bytes)))
+			_evict(&key);
+		it = entries.emplace(std::piecewise_construct, std::forward_as_tuple(key),
+			std::forward_as_tuple(key, std::move(value), bytes)).first;
+		used_bytes += bytes;
+		policy.on_insert(it->second, it->second.key);
+		_fit_policy();
+		return it->second.value;
+	}
+
+	// updates the bytes charged for a cached value that grew or shrank in
+	// place, evicting other entries if that breaks the budget
+
+	void resize(const Key &key, std::size_t bytes){
+		auto it = entries.find(key);
+		if (it == entries.end())
+			return;
+		bytes += ENTRY_OVERHEAD;
+		used_bytes = used_bytes - it->second.bytes + bytes;
+		it->second.bytes = bytes;
+		_shrink(key);
+		_fit_policy();
+	}
+
+	// removes the policy's victim, returns false if empty
+
+	bool evict(){
+		if (entries.empty())
+			return false;
+		_evict(nullptr);
+		return true;
+	}
+
+	bool erase(const Key &key){
+		auto it = entries.find(key);
+		if (it == entries.end())
+			return false;
+		policy.on_erase(it->second, false);
+		used_bytes -= it->second.bytes;
+		entries.erase(it);
+		return true;
+	}
+
+	// access count of key, 0 if it is not cached (counting policies only)
+
+	unsigned int frequency(const Key &key) const {
+		auto it = entries.find(key);
+		return it == entries.end() ? 0 : policy.frequency(it->second);
+	}
+
+	// calls f(key, value) for up to limit entries, the ones the policy would
+	// keep longest first, without counting accesses. f must not modify the
+	// cache.
+
+	template <typename F>
+	void for_each_hottest(F f, std::size_t limit = SIZE_MAX){
+		if (!limit)
+			return;
+		policy.for_each_hottest([&](node &n) {
+			entry &e = static_cast<entry &>(n);
+			f(e.key, e.value);
+			return --limit > 0;
+		});
+	}
+
+	bool contains(const Key &key) const { return entries.find(key) != entries.end(); }
+	std::size_t size() const { return entries.size(); }
+	std::size_t max_size() const { return capacity; }
+	std::size_t bytes_used() const { return used_bytes; }
+	uint64_t evictions() const { return evicted; } // by the policy, over the cache's lifetime
+	std::size_t max_bytes_used() const { return max_bytes; }
+
+	// whether inserting a new entry holding bytes would evict another
+	bool full(std::size_t bytes = 0) const {
+		return !entries.empty() && (entries.size() >= capacity || _over_budget(bytes + ENTRY_OVERHEAD));
+	}
+
+	void clear(){
+		policy.clear();
+		entries.clear();
+		used_bytes = 0;
+	}
+};
+
+// the cache as LFU_cache_client has always used it
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+using lfu_cache = policy_cache<Key, Value, lfu_policy, Hash>;
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * @file pool_allocator.h
+ *
+ * Slab allocation for the caches' fixed size nodes. A cache under churn
+ * allocates and frees the same few node types (map entries, frequency
+ * buckets, ghost records) over and over; slab_pool hands those out from
+ * larger slabs and keeps freed slots on a free list, so an eviction
+ * followed by an insert reuses the slot instead of going back to malloc.
+ * Slabs are only released when the pool is destroyed.
+ *
+ * pool_allocator is the standard allocator interface over a set of pools,
+ * one per slot size, so node based containers (std::unordered_map,
+ * std::list) can use it. Single object allocations come from the pools,
+ * arrays (hash buckets) still go to operator new. Containers that share an
+ * allocator share its pools. A pool is not thread safe, it belongs to one
+ * cache and is used under whatever serializes that cache.
+ */
+#ifndef POOL_ALLOCATOR_H
+#define POOL_ALLOCATOR_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace detail {
+
+class slab_pool {
+	struct free_slot {
+		free_slot *next;
+	};
+
+	std::size_t slot_size, slots_per_slab;
+	std::vector<std::unique_ptr<unsigned char[]>> slabs;
+	free_slot *free = nullptr;
+	std::size_t next_unused = 0; // first never used slot of the newest slab
+	std::size_t live = 0;
+
+	public:
+
+	// size of the slots serving objects of size bytes
+	static std::size_t slot_size_for(std::size_t size){
+		const std::size_t align = alignof(std::max_align_t);
+		return (std::max(size, sizeof(free_slot)) + align - 1) / align * align;
+	}
+
+	// slots_per_slab defaults to roughly 4KB per slab, at least 16 slots
+	slab_pool(std::size_t size, std::size_t slots_per_slab = 0)
+		: slot_size(slot_size_for(size)),
+		  slots_per_slab(slots_per_slab ? slots_per_slab : std::max<std::size_t>(16, 4096 / slot_size)) {
+		next_unused = this->slots_per_slab;
+	}
+	slab_pool(const slab_pool &) = delete;
+	slab_pool &operator=(const slab_pool &) = delete;
+
+	void *allocate(){
+		live++;
+		if (free) {
+			free_slot *slot = free;
+			free = slot->next;
+			return slot;
+		}
+		if (next_unused == slots_per_slab) {
+			slabs.emplace_back(new unsigned char[slot_size * slots_per_slab]);
+			next_unused = 0;
+		}
+		return slabs.back().get() + slot_size * next_unused++;
+	}
+
+	void deallocate(void *p){
+		live--;
+		free_slot *slot = static_cast<free_slot *>(p);
+		slot->next = free;
+		free = slot;
+	}
+
+	std::size_t size() const { return slot_size; }
+	std::size_t in_use() const { return live; }
+	std::size_t reserved() const { return slabs.size() * slots_per_slab; }
+};
+
+// the pools behind one family of pool_allocators, looked up by slot size
+// when an allocator is constructed or rebound
+
+class pool_set {
+	std::vector<std::unique_ptr<slab_pool>> pools;
+
+	public:
+
+	slab_pool &pool_for(std::size_t size){
+		std::size_t rounded = slab_pool::slot_size_for(size);
+		for (auto &pool : pools)
+			if (pool->size() == rounded)
+				return *pool;
+		pools.push_back(std::make_unique<slab_pool>(size));
+		return *pools.back();
+	}
+};
+
+template <typename T>
+class pool_allocator {
+	static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types are not pooled");
+
+	template <typename> friend class pool_allocator;
+
+	std::shared_ptr<pool_set> pools;
+	slab_pool *slots;
+
+	public:
+
+	typedef T value_type;
+
+	pool_allocator() : pools(std::make_shared<pool_set>()), slots(&pools->pool_for(sizeof(T))) {};
+
+	template <typename U>
+	pool_allocator(const pool_allocator<U> &other)
+		: pools(other.pools), slots(&pools->pool_for(sizeof(T))) {};
+
+	T *allocate(std::size_t n){
+		if (n == 1)
+			return static_cast<T *>(slots->allocate());
+		return static_cast<T *>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, std::size_t n){
+		if (n == 1)
+			slots->deallocate(p);
+		else
+			::operator delete(p);
+	}
+
+	// slots handed out and slots allocated for T, for tests and tuning
+	std::size_t in_use() const { return slots->in_use(); }
+	std::size_t reserved() const { return slots->reserved(); }
+
+	template <typename U>
+	bool operator==(const pool_allocator<U> &other) const { return pools == other.pools; }
+	template <typename U>
+	bool operator!=(const pool_allocator<U> &other) const { return pools != other.pools; }
+};
+
+}
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * @file synthetic.h
+ *
+ * Workloads that do not need the weather service: synthetic_fetcher makes
+ * up a forecast for any location in process, and zipf_trace() draws key
+ * sequences with the skew real location traffic has. Used by the tests, the
+ * benchmarks and the trace tools, so their numbers do not depend on the
+ * network.
+ */
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include "forecast_fetcher.h"
+#include "forecast_index.h"
+
+// Answers every request with a 40 point, three hourly forecast starting at
+// first_dt. Temperatures depend only on the location and have two decimals
+// like the service's. Requests complete on the calling thread after latency.
+// The class is final so fetch_source can call it without a virtual call.
+
+class synthetic_fetcher final : public forecast_fetcher {
+	int32_t first_dt;
+	std::chrono::microseconds latency;
+	std::atomic<uint64_t> requests{0};
+
+	public:
+
+	static const int POINTS = 40;
+
+	synthetic_fetcher(int32_t first_dt = 1659722400,
+			std::chrono::microseconds latency = std::chrono::microseconds::zero())
+		: first_dt(first_dt), latency(latency) {};
+
+	static forecast_index forecast_for(double lat, double lon, int32_t first_dt){
+		std::vector<int32_t> dt;
+		std::vector<double> temp;
+		double base = 283.15 - std::fabs(lat) / 3 + std::fmod(std::fabs(lon), 7.0);
+		for (int k = 0; k < POINTS; k++) {
+			dt.push_back(first_dt + k * 3 * 60 * 60);
+			temp.push_back(std::round((base + 4 * std::sin(k * 0.785)) * 100) / 100);
+		}
+		return forecast_index(dt, temp);
+	}
+
+	void fetch_async(double lat, double lon, callback done) override {
+		requests.fetch_add(1, std::memory_order_relaxed);
+		if (latency != std::chrono::microseconds::zero())
+			std::this_thread::sleep_for(latency);
+		done(std::make_shared<const forecast_index>(forecast_for(lat, lon, first_dt)), nullptr);
+	}
+
+	uint64_t request_count() const { return requests.load(std::memory_order_relaxed); }
+};
+
+// length keys in [0, keys) where key k is drawn with probability proportional to 1 / (k + 1)
+
+inline std::vector<int> zipf_trace(std::size_t length, int keys, unsigned int seed){
+	std::vector<double> weights;
+	for (int k = 1; k <= keys; k++)
+		weights.push_back(1.0 / k);
+	std::mt19937 random(seed);
+	std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+	std::vector<int> trace;
+	for (std::size_t i = 0; i < length; i++)
+		trace.push_back(zipf(random));
+	return trace;
+}
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * @file trace_replay.cpp
+ *
+ * Replays an access log against the cache offline and prints the hit rate
+ * and upstream request rate of each policy over a sweep of capacities (see
+ * trace_replay.h for the trace format).
+ *
+ *	./trace_replay.out [options] trace.csv
+ *
+ *	--policies lru,lfu,...   policies to replay, all of them by default
+ *	--capacities 64,256,...  cache sizes in entries
+ *	--max-age seconds        expiry_policy::max_age, none by default
+ *	--cell degrees           location_grid cell size
+ *	--threads n              replays run at once, one per core by default
+ *	--zipf length            replay a synthetic Zipf trace instead of a file
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "synthetic.h"
+#include "trace_replay.h"
+
+namespace {
+
+std::vector<std::string> split(const std::string &list){
+	std::vector<std::string> items;
+	std::istringstream in(list);
+	for (std::string item; std::getline(in, item, ',');)
+		if (!item.empty())
+			items.push_back(item);
+	return items;
+}
+
+// an hour of requests over keys locations, Zipf distributed
+std::vector<trace_record> zipf_records(size_t length, int keys){
+	std::vector<trace_record> trace;
+	int64_t first = 1659722400;
+	auto ids = zipf_trace(length, keys, 17);
+	for (size_t i = 0; i < ids.size(); i++) {
+		int64_t now = first + (int64_t)(i * 3600 / length);
+		trace.push_back({now, 30 + (ids[i] % 100) * 0.05, -120 + (ids[i] / 100) * 0.05,
+			(int32_t)now, (int32_t)(now + 24 * 3600)});
+	}
+	return trace;
+}
+
+int usage(const char *program){
+	std::fprintf(stderr, "usage: %s [--policies list] [--capacities list] [--max-age seconds] "
+		"[--cell degrees] [--threads n] (--zipf length | trace.csv)\n", program);
+	return 2;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<replay_policy> policies = builtin_replay_policies();
+	std::vector<size_t> capacities = {64, 256, 1024, 4096};
+	replay_options options;
+	unsigned int threads = 0;
+	size_t zipf_length = 0;
+	const char *path = nullptr;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg.compare(0, 2, "--") != 0) {
+			path = argv[i];
+			continue;
+		}
+		if (i + 1 == argc)
+			return usage(argv[0]);
+		std::string value = argv[++i];
+		if (arg == "--policies") {
+			std::vector<replay_policy> chosen;
+			for (auto &name : split(value)) {
+				auto it = std::find_if(policies.begin(), policies.end(),
+					[&](const replay_policy &p) { return p.name == name; });
+				if (it == policies.end()) {
+					std::fprintf(stderr, "unknown policy %s\n", name.c_str());
+					return 2;
+				}
+				chosen.push_back(*it);
+			}
+			policies = chosen;
+		} else if (arg == "--capacities") {
+			capacities.clear();
+			for (auto &capacity : split(value))
+				capacities.push_back(std::strtoul(capacity.c_str(), nullptr, 10));
+		} else if (arg == "--max-age") {
+			options.expiry.max_age = std::chrono::seconds(std::atol(value.c_str()));
+		} else if (arg == "--cell") {
+			options.grid = location_grid(std::atof(value.c_str()));
+		} else if (arg == "--threads") {
+			threads = (unsigned int)std::atoi(value.c_str());
+		} else if (arg == "--zipf") {
+			zipf_length = std::strtoul(value.c_str(), nullptr, 10);
+		} else {
+			return usage(argv[0]);
+		}
+	}
+	if (!path && !zipf_length)
+		return usage(argv[0]);
+
+	std::vector<trace_record> trace;
+	try {
+		if (zipf_length) {
+			trace = zipf_records(zipf_length, 10000);
+		} else {
+			std::ifstream in(path);
+			if (!in) {
+				std::fprintf(stderr, "cannot open %s\n", path);
+				return 1;
+			}
+			trace = read_trace(in);
+		}
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "%s: %s\n", path, e.what());
+		return 1;
+	}
+
+	auto results = sweep(trace, policies, capacities, options, threads);
+	std::printf("%-10s %10s %10s %9s %10s %10s %12s\n",
+		"policy", "capacity", "requests", "hit rate", "upstream", "evictions", "upstream/h");
+	for (auto &r : results)
+		std::printf("%-10s %10zu %10llu %9.4f %10llu %10llu %12.1f\n", r.policy.c_str(), r.capacity,
+			(unsigned long long)r.requests, r.hit_rate(), (unsigned long long)r.upstream,
+			(unsigned long long)r.evictions, r.upstream_rate() * 3600);
+	return 0;
+}
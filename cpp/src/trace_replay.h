@@ -0,0 +1,194 @@
+/*
+ * @file trace_replay.h
+ *
+ * Offline replay of access logs against the cache, for picking a cache size
+ * and an eviction policy. A trace is a list of requests (timestamp, lat,
+ * lon, start, end); replay() drives an LFU_cache_client with one policy and
+ * capacity through it, without touching the network. Its clock follows the
+ * trace timestamps, so expiry behaves as it did when the log was written.
+ * Each replay gets a replay_fetcher, which makes up forecasts in process
+ * and counts them: every fetch it gets would have been a request to the
+ * weather service.
+ *
+ * sweep() replays every policy at every capacity. The trace is read once
+ * and shared, and the replays run in parallel on worker threads, each with
+ * its own client.
+ */
+#ifndef TRACE_REPLAY_H
+#define TRACE_REPLAY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <exception>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cache_clients.h"
+#include "eviction_policies.h"
+#include "metrics.h"
+#include "synthetic.h"
+
+// one request of an access log, times in unix seconds
+struct trace_record {
+	int64_t timestamp;
+	double lat, lon;
+	int32_t start, end;
+};
+
+// Reads a trace, one "timestamp,lat,lon,start,end" record per line. Blank
+// lines and lines starting with # are skipped; anything else that does not
+// parse throws std::runtime_error naming the line.
+
+inline std::vector<trace_record> read_trace(std::istream &in){
+	std::vector<trace_record> trace;
+	std::string line;
+	for (size_t number = 1; std::getline(in, line); number++) {
+		if (line.empty() || line[0] == '#' || line.find_first_not_of(" \t\r") == std::string::npos)
+			continue;
+		std::istringstream fields(line);
+		trace_record r;
+		char c1, c2, c3, c4;
+		if (!(fields >> r.timestamp >> c1 >> r.lat >> c2 >> r.lon >> c3 >> r.start >> c4 >> r.end) ||
+				c1 != ',' || c2 != ',' || c3 != ',' || c4 != ',' || (fields >> std::ws, !fields.eof()))
+			throw std::runtime_error("malformed trace record on line " + std::to_string(number));
+		trace.push_back(r);
+	}
+	return trace;
+}
+
+// Upstream for a replay: answers with a synthetic forecast whose first point
+// is the three hour boundary at or before the trace's current time, so
+// first_point_lag expiry sees forecasts as fresh as the live service's.
+
+class replay_fetcher : public forecast_fetcher {
+	std::atomic<int64_t> now{0};
+	std::atomic<uint64_t> requests{0};
+
+	public:
+
+	void set_time(int64_t timestamp){ now.store(timestamp, std::memory_order_relaxed); }
+
+	void fetch_async(double lat, double lon, callback done) override {
+		requests.fetch_add(1, std::memory_order_relaxed);
+		int64_t t = now.load(std::memory_order_relaxed);
+		int32_t first_dt = (int32_t)(t - (t % (3 * 60 * 60)));
+		done(std::make_shared<const forecast_index>(synthetic_fetcher::forecast_for(lat, lon, first_dt)), nullptr);
+	}
+
+	uint64_t request_count() const { return requests.load(std::memory_order_relaxed); }
+};
+
+struct replay_options {
+	expiry_policy expiry;
+	location_grid grid;
+};
+
+struct replay_result {
+	std::string policy;
+	size_t capacity = 0;
+	uint64_t requests = 0;
+	uint64_t hits = 0, misses = 0, evictions = 0, expirations = 0;
+	uint64_t upstream = 0; // fetches that would have gone to the service
+	int64_t duration = 0;  // trace seconds from the first to the last request
+
+	double hit_rate() const { return requests ? (double)hits / (double)requests : 0; }
+
+	// upstream requests per second of trace time
+	double upstream_rate() const { return duration > 0 ? (double)upstream / (double)duration : (double)upstream; }
+};
+
+template <template <typename, typename> class Policy>
+replay_result replay(const std::vector<trace_record> &trace, size_t capacity,
+		const replay_options &options = replay_options()){
+	auto fetcher = std::make_shared<replay_fetcher>();
+	auto metrics = std::make_shared<forecast_metrics>();
+	LFU_cache_client<Policy> cache((unsigned int)capacity, options.expiry, options.grid, fetcher);
+	cache.set_metrics(metrics);
+	int64_t now = trace.empty() ? 0 : trace.front().timestamp;
+	cache.set_clock([&now]() { return forecast_clock::from_time_t((time_t)now); });
+	double scratch[64]; // the series itself is not looked at, only the path to it
+	for (auto &r : trace) {
+		now = r.timestamp;
+		fetcher->set_time(now);
+		cache.set_pair(r.lat, r.lon);
+		cache.query(r.start, r.end, scratch, 64);
+	}
+	auto counts = metrics->snapshot();
+	replay_result result;
+	result.capacity = capacity;
+	result.requests = trace.size();
+	result.hits = counts.hits;
+	result.misses = counts.misses;
+	result.evictions = counts.evictions;
+	result.expirations = counts.expirations;
+	result.upstream = fetcher->request_count();
+	if (!trace.empty())
+		result.duration = trace.back().timestamp - trace.front().timestamp;
+	return result;
+}
+
+// a policy sweep() can run, replay<Policy> under a name
+struct replay_policy {
+	std::string name;
+	std::function<replay_result(const std::vector<trace_record> &, size_t, const replay_options &)> run;
+};
+
+template <template <typename, typename> class Policy>
+replay_policy make_replay_policy(const std::string &name){
+	return {name, replay<Policy>};
+}
+
+// the policies of eviction_policies.h
+inline std::vector<replay_policy> builtin_replay_policies(){
+	return {
+		make_replay_policy<lru_policy>("lru"),
+		make_replay_policy<lfu_policy>("lfu"),
+		make_replay_policy<aging_lfu_policy>("aging_lfu"),
+		make_replay_policy<w_tinylfu_policy>("w_tinylfu"),
+		make_replay_policy<arc_policy>("arc"),
+	};
+}
+
+// Replays every policy at every capacity on up to threads workers (0 for
+// one per core). Results come back ordered by policy, then capacity as
+// given. The first exception a replay throws is rethrown once all stop.
+
+inline std::vector<replay_result> sweep(const std::vector<trace_record> &trace,
+		const std::vector<replay_policy> &policies, const std::vector<size_t> &capacities,
+		const replay_options &options = replay_options(), unsigned int threads = 0){
+	std::vector<replay_result> results(policies.size() * capacities.size());
+	std::vector<std::exception_ptr> errors(results.size());
+	std::atomic<size_t> next{0};
+	auto work = [&]() {
+		for (size_t job; (job = next.fetch_add(1)) < results.size();) {
+			auto &policy = policies[job / capacities.size()];
+			try {
+				results[job] = policy.run(trace, capacities[job % capacities.size()], options);
+				results[job].policy = policy.name;
+			} catch (...) {
+				errors[job] = std::current_exception();
+			}
+		}
+	};
+	if (!threads)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::thread> workers;
+	for (unsigned int i = 1; i < std::min<size_t>(threads, results.size()); i++)
+		workers.emplace_back(work);
+	work();
+	for (auto &worker : workers)
+		worker.join();
+	for (auto &error : errors)
+		if (error)
+			std::rethrow_exception(error);
+	return results;
+}
+
+#endif